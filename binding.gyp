@@ -4,11 +4,31 @@
       "target_name": "pathwatcher",
       "sources": [
         "src/main.cc",
+        "src/path_filter.cc",
+        "src/path_filter.h",
+        "src/path_poller.cc",
+        "src/path_poller.h",
+        "src/block_hashes.cc",
+        "src/block_hashes.h",
         "src/common.cc",
         "src/common.h",
+        "src/digest.cc",
+        "src/digest.h",
+        "src/directory_listing.cc",
+        "src/directory_listing.h",
+        "src/event_coalescer.cc",
+        "src/event_coalescer.h",
+        "src/event_journal.cc",
+        "src/event_journal.h",
+        "src/event_queue.h",
+        "src/file_reader.cc",
+        "src/file_reader.h",
         "src/handle_map.cc",
         "src/handle_map.h",
-        "src/unsafe_persistent.h",
+        "src/tree_snapshot.cc",
+        "src/tree_snapshot.h",
+        "src/watch_registry.cc",
+        "src/watch_registry.h",
       ],
       "include_dirs": [
         "src",
@@ -44,6 +64,9 @@
           "sources": [
             "src/pathwatcher_linux.cc",
           ],
+          "libraries": [
+            "-ldl",
+          ],
         }],  # OS=="linux"
         ['OS!="win" and OS!="linux"', {
           "sources": [
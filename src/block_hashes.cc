@@ -0,0 +1,77 @@
+#include "block_hashes.h"
+
+#include <algorithm>
+
+#include <uv.h>
+
+#include "digest.h"
+
+// Files are read in chunks of at least this size, made of whole blocks.
+static const size_t kReadChunkSize = 256 * 1024;
+
+static int HashBlocks(uv_file fd, size_t block_size, BlockHashes* blocks) {
+  size_t blocks_per_chunk = std::max<size_t>(kReadChunkSize / block_size, 1);
+  std::vector<char> chunk(blocks_per_chunk * block_size);
+
+  uv_fs_t req;
+  size_t filled = 0;
+  for (;;) {
+    uv_buf_t buf = uv_buf_init(chunk.data() + filled,
+                               static_cast<unsigned int>(chunk.size() - filled));
+    int r = uv_fs_read(NULL, &req, fd, &buf, 1, -1, NULL);
+    uv_fs_req_cleanup(&req);
+    if (r < 0)
+      return r;
+    filled += r;
+    blocks->size += r;
+
+    // Short reads leave partial blocks to be completed by the next one, only
+    // the end of the file may hash a shorter block.
+    size_t hashed = r == 0 ? filled : filled - filled % block_size;
+    for (size_t offset = 0; offset < hashed; offset += block_size) {
+      size_t length = std::min(block_size, hashed - offset);
+      blocks->hashes.push_back(Xxh64(chunk.data() + offset, length));
+    }
+    if (r == 0)
+      return 0;
+    std::copy(chunk.begin() + hashed, chunk.begin() + filled, chunk.begin());
+    filled -= hashed;
+  }
+}
+
+int HashFileBlocks(const std::string& path, size_t block_size, BlockHashes* blocks) {
+  blocks->size = 0;
+  blocks->hashes.clear();
+
+  uv_fs_t req;
+  uv_file fd = uv_fs_open(NULL, &req, path.c_str(), UV_FS_O_RDONLY, 0, NULL);
+  uv_fs_req_cleanup(&req);
+  if (fd < 0)
+    return fd;
+
+  int r = HashBlocks(fd, block_size, blocks);
+  uv_fs_close(NULL, &req, fd, NULL);
+  uv_fs_req_cleanup(&req);
+  return r;
+}
+
+void DiffBlockHashes(const BlockHashes& previous,
+                     const BlockHashes& current,
+                     size_t block_size,
+                     std::vector<ByteRange>* ranges) {
+  for (size_t i = 0; i < current.hashes.size(); ++i) {
+    // A block that only got shorter or longer hashes differently, as the
+    // hash covers its length.
+    if (i < previous.hashes.size() && previous.hashes[i] == current.hashes[i])
+      continue;
+
+    uint64_t start = static_cast<uint64_t>(i) * block_size;
+    uint64_t end = std::min<uint64_t>(start + block_size, current.size);
+    if (!ranges->empty() && ranges->back().end == start) {
+      ranges->back().end = end;
+    } else {
+      ByteRange range = { start, end };
+      ranges->push_back(range);
+    }
+  }
+}
@@ -0,0 +1,35 @@
+#ifndef SRC_BLOCK_HASHES_H_
+#define SRC_BLOCK_HASHES_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// Hashes of the fixed size blocks of a file, to tell which parts of it
+// changed between two versions without keeping the contents around.
+struct BlockHashes {
+  uint64_t size;
+  std::vector<uint64_t> hashes;
+};
+
+struct ByteRange {
+  uint64_t start;
+  uint64_t end;
+};
+
+// Hashes |path| in blocks of |block_size| bytes, the last one possibly
+// shorter. Returns 0 or a negative libuv error code. Safe to call from any
+// thread.
+int HashFileBlocks(const std::string& path, size_t block_size, BlockHashes* blocks);
+
+// Appends the ranges of |current| whose blocks differ from |previous|, both
+// hashed with |block_size|, with adjacent blocks merged into one range.
+// Blocks past the end of |previous| differ, what was cut off the end of it is
+// only told by |current.size|.
+void DiffBlockHashes(const BlockHashes& previous,
+                     const BlockHashes& current,
+                     size_t block_size,
+                     std::vector<ByteRange>* ranges);
+
+#endif  // SRC_BLOCK_HASHES_H_
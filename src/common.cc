@@ -1,72 +1,412 @@
+#include <string.h>
+#ifndef _WIN32
+#include <dlfcn.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <set>
+#include <unordered_map>
+
+#include "block_hashes.h"
 #include "common.h"
+#include "digest.h"
+#include "directory_listing.h"
+#include "event_coalescer.h"
+#include "event_journal.h"
+#include "event_queue.h"
+#include "file_reader.h"
+#include "tree_snapshot.h"
+#include "watch_registry.h"
+
+// Number of events that can be pending for an environment. When it is full
+// the watcher thread drops events rather than waiting for the JS thread.
+static const size_t kEventQueueCapacity = 1 << 14;
+
+// State of one Node.js environment (the main thread or a worker) that loaded
+// the addon. It owns the handles it watched, and the watcher thread routes
+// their events to its queue.
+struct Environment {
+  Environment() : queue(kEventQueueCapacity),
+                  dropped_count(0),
+                  overflowed(false),
+                  default_coalesce_ms(0),
+                  async_resource(NULL),
+                  pending_watches(0),
+                  closing(false) {}
+
+  uv_async_t async;
+  EventQueue<WatcherEvent> queue;
+  // Events dropped because the queue was full, handles are asked to rescan
+  // once the JS thread catches up.
+  std::atomic<uint32_t> dropped_count;
+  std::atomic<bool> overflowed;
+  // Events kept to be pulled with changesSince(), off until enabled.
+  EventJournal journal;
+
+  // Everything below is only touched by the environment's own thread.
+  WatchRegistry registry;
+  int default_coalesce_ms;
+  // Handles without a coalesce window of their own.
+  std::set<WatcherHandle> default_window_handles;
+  Nan::AsyncResource* async_resource;
+  Nan::Persistent<Function> callback;
+  Nan::Persistent<Function> batch_callback;
+  // Watches being added on the threadpool, the environment is only freed once
+  // they are done.
+  int pending_watches;
+  bool closing;
+#if NODE_VERSION_AT_LEAST(14, 8, 0)
+  node::AsyncCleanupHookHandle cleanup_hook;
+  void (*cleanup_done)(void*);
+  void* cleanup_done_arg;
+#endif
+};
+
+// Latencies from the backend to the JS callback are counted in power of two
+// buckets of microseconds, the last one also takes everything slower.
+static const int kLatencyBuckets = 24;
+
+// Counters of the event pipeline for getStats(). Relaxed atomics keep them
+// cheap enough to always be on.
+struct PipelineStats {
+  std::atomic<uint64_t> kernel_events;
+  std::atomic<uint64_t> kernel_bytes;
+  std::atomic<uint64_t> filtered;
+  std::atomic<uint64_t> suppressed;
+  std::atomic<uint64_t> dropped;
+  std::atomic<uint64_t> overflows;
+  std::atomic<uint64_t> delivered;
+  std::atomic<uint64_t> queue_wait_ns;
+  std::atomic<uint64_t> latency[kLatencyBuckets];
+};
+static PipelineStats g_stats;
+
+static void Count(std::atomic<uint64_t>* counter, uint64_t value = 1) {
+  counter->fetch_add(value, std::memory_order_relaxed);
+}
+
+static void CountLatency(uint64_t posted_at, uint64_t now) {
+  if (posted_at == 0)
+    return;
+
+  uint64_t us = (now - posted_at) / 1000;
+  int bucket = 0;
+  while (us > 0 && bucket < kLatencyBuckets - 1) {
+    us >>= 1;
+    ++bucket;
+  }
+  Count(&g_stats.latency[bucket]);
+}
 
-static uv_async_t g_async;
-static int g_watch_count;
+static uv_once_t g_init_once = UV_ONCE_INIT;
 static uv_sem_t g_semaphore;
 static uv_thread_t g_thread;
 
-static EVENT_TYPE g_type;
-static WatcherHandle g_handle;
-static std::vector<char> g_new_path;
-static std::vector<char> g_old_path;
-static Nan::Persistent<Function> g_callback;
+// Shared by every environment and the watcher thread, which runs until the
+// process exits, so they are never destroyed.
+static EventCoalescer* g_coalescer;
+// Guards g_owners, an environment is only destroyed after its handles have
+// been removed from it.
+static uv_mutex_t g_owners_mutex;
+static std::unordered_map<WatcherHandle, Environment*>* g_owners;
+// Events of watches added on the threadpool, held back until the JS thread
+// knows their handle. Also guarded by g_owners_mutex.
+static std::unordered_map<WatcherHandle, std::vector<WatcherEvent> >* g_held;
+
+// Bound of the paths whose stat is remembered for each watch.
+static const size_t kMaxTrackedStats = 4096;
+// Most bytes an event of a watch with the tail option carries, the watcher
+// thread asks for a reload rather than reading more.
+static const size_t kMaxTailSize = 1 << 20;
+
+struct TrackedStat {
+  EventStat stat;
+  // Wall clock time the stat was taken at.
+  uint64_t taken_ns;
+};
+
+// Watched path and filter of every handle, for the watcher thread to resolve
+// the paths of its events.
+struct WatchedPath {
+  std::string path;
+  std::shared_ptr<const PathFilter> filter;
+  bool stat;
+  // Last stat of the paths with events, for watches with the stat option.
+  std::unordered_map<std::string, TrackedStat> stats;
+  bool tail;
+  // How far the files with events were read, for watches with the tail
+  // option.
+  std::unordered_map<std::string, TailPosition> tails;
+  size_t block_size;
+  // Hashes of the watched file as of the last DiffWatchBlocks, for watches
+  // with the blocks option. Taken out while a diff runs.
+  bool has_blocks;
+  BlockHashes blocks;
+};
+static uv_mutex_t g_watched_mutex;
+static std::unordered_map<WatcherHandle, WatchedPath>* g_watched;
+
+// State of the watched path taken before the watch starts, so that the first
+// change is compared to it.
+struct WatchBaseline {
+  bool has_stat;
+  TrackedStat stat;
+  bool has_tail;
+  TailPosition tail;
+};
+
+// Event posted for a handle that PlatformWatch had not returned yet.
+struct UnregisteredEvent {
+  EVENT_TYPE type;
+  WatcherHandle handle;
+  std::vector<char> new_path;
+  std::vector<char> old_path;
+  bool attributes_only;
+};
+// Watches being added, while there are any events of unknown handles are kept
+// for them in g_unregistered. Both are guarded by g_watched_mutex.
+static std::atomic<size_t> g_registering(0);
+static std::vector<UnregisteredEvent>* g_unregistered;
+// Let PostEvent skip the lookups while no watch has a filter or the stat
+// option.
+static std::atomic<size_t> g_filter_count(0);
+static std::atomic<size_t> g_stat_count(0);
+static std::atomic<size_t> g_tail_count(0);
+
+uint64_t WallClockNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static bool StatPath(const std::string& path, TrackedStat* tracked) {
+  uv_fs_t req;
+  int r = uv_fs_stat(NULL, &req, path.c_str(), NULL);
+  if (r < 0) {
+    uv_fs_req_cleanup(&req);
+    return false;
+  }
+
+  const uv_stat_t& s = req.statbuf;
+  EventStat stat = {
+    true,
+    s.st_ino,
+    s.st_size,
+    static_cast<uint64_t>(s.st_mtim.tv_sec) * 1000000000 + s.st_mtim.tv_nsec,
+    static_cast<uint32_t>(s.st_mode),
+  };
+  uv_fs_req_cleanup(&req);
+
+  tracked->stat = stat;
+  tracked->taken_ns = WallClockNs();
+  return true;
+}
+
+static void TakeWatchBaseline(const std::string& path,
+                              const WatchOptions& options,
+                              WatchBaseline* baseline) {
+  // The first change of the watched path is compared to its stat from now.
+  baseline->has_stat = options.stat && StatPath(path, &baseline->stat);
+  // And only what is appended from now on is delivered.
+  baseline->has_tail =
+      options.tail && GetTailPosition(path, &baseline->tail) == 0;
+}
+
+// Takes the events posted for |handle| before it was known into |stashed|.
+static void SetWatchedPath(WatcherHandle handle,
+                           const std::string& path,
+                           const WatchOptions& options,
+                           const WatchBaseline& baseline,
+                           std::vector<UnregisteredEvent>* stashed) {
+  ScopedLocker locker(g_watched_mutex);
+  std::vector<UnregisteredEvent> others;
+  for (size_t i = 0; i < g_unregistered->size(); ++i) {
+    UnregisteredEvent& event = (*g_unregistered)[i];
+    if (event.handle == handle)
+      stashed->push_back(std::move(event));
+    else
+      others.push_back(std::move(event));
+  }
+  g_unregistered->swap(others);
+
+  WatchedPath& entry = (*g_watched)[handle];
+  if (entry.filter)
+    --g_filter_count;
+  if (entry.stat)
+    --g_stat_count;
+  if (entry.tail)
+    --g_tail_count;
+  entry.path = path;
+  entry.filter = options.filter;
+  entry.stat = options.stat;
+  entry.stats.clear();
+  if (baseline.has_stat)
+    entry.stats[path] = baseline.stat;
+  entry.tail = options.tail;
+  entry.tails.clear();
+  if (baseline.has_tail)
+    entry.tails[path] = baseline.tail;
+  // Hashed on the threadpool by the first DiffWatchBlocks.
+  entry.block_size = options.block_size;
+  entry.has_blocks = false;
+  entry.blocks = BlockHashes();
+  if (entry.filter)
+    ++g_filter_count;
+  if (entry.stat)
+    ++g_stat_count;
+  if (entry.tail)
+    ++g_tail_count;
+}
+
+static void RemoveWatchedPath(WatcherHandle handle) {
+  ScopedLocker locker(g_watched_mutex);
+  std::unordered_map<WatcherHandle, WatchedPath>::iterator iter =
+      g_watched->find(handle);
+  if (iter == g_watched->end())
+    return;
+
+  if (iter->second.filter)
+    --g_filter_count;
+  if (iter->second.stat)
+    --g_stat_count;
+  if (iter->second.tail)
+    --g_tail_count;
+  g_watched->erase(iter);
+}
+
+static Environment* GetEnvironment(const Nan::FunctionCallbackInfo<Value>& info) {
+  return static_cast<Environment*>(info.Data().As<External>()->Value());
+}
 
 static void CommonThread(void* handle) {
   WaitForMainThread();
   PlatformThread();
 }
 
+static const char* EventTypeToString(EVENT_TYPE type) {
+  switch (type) {
+    case EVENT_CHANGE:
+      return "change";
+    case EVENT_DELETE:
+      return "delete";
+    case EVENT_RENAME:
+      return "rename";
+    case EVENT_CHILD_CREATE:
+      return "child-create";
+    case EVENT_CHILD_CHANGE:
+      return "child-change";
+    case EVENT_CHILD_DELETE:
+      return "child-delete";
+    case EVENT_CHILD_RENAME:
+      return "child-rename";
+    case EVENT_RESCAN:
+      return "rescan";
+    case EVENT_RESURRECT:
+      return "resurrect";
+    default:
+      return "unknown";
+  }
+}
+
+static Local<String> EventTypeToV8Value(EVENT_TYPE type) {
+  return Nan::New(EventTypeToString(type)).ToLocalChecked();
+}
+
+static Local<Object> EventToV8Value(const WatcherEvent& event) {
+  Local<Object> obj = Nan::New<Object>();
+  Nan::Set(obj, Nan::New("type").ToLocalChecked(),
+           EventTypeToV8Value(event.type));
+  Nan::Set(obj, Nan::New("handle").ToLocalChecked(),
+           WatcherHandleToV8Value(event.handle));
+  Nan::Set(obj, Nan::New("path").ToLocalChecked(),
+           Nan::New(event.new_path.data(), event.new_path.size()).ToLocalChecked());
+  Nan::Set(obj, Nan::New("oldPath").ToLocalChecked(),
+           Nan::New(event.old_path.data(), event.old_path.size()).ToLocalChecked());
+  Nan::Set(obj, Nan::New("count").ToLocalChecked(),
+           Nan::New<Integer>(event.count));
+  if (event.stat.valid) {
+    Local<Object> stat = Nan::New<Object>();
+    Nan::Set(stat, Nan::New("ino").ToLocalChecked(),
+             Nan::New<Number>(static_cast<double>(event.stat.ino)));
+    Nan::Set(stat, Nan::New("size").ToLocalChecked(),
+             Nan::New<Number>(static_cast<double>(event.stat.size)));
+    Nan::Set(stat, Nan::New("mtimeMs").ToLocalChecked(),
+             Nan::New<Number>(event.stat.mtime_ns / 1e6));
+    Nan::Set(stat, Nan::New("mode").ToLocalChecked(),
+             Nan::New<Uint32>(event.stat.mode));
+    Nan::Set(obj, Nan::New("stat").ToLocalChecked(), stat);
+  }
+  if (event.tail == TAIL_APPENDED) {
+    Nan::Set(obj, Nan::New("appended").ToLocalChecked(),
+             Nan::CopyBuffer(event.appended.data(), event.appended.size()).ToLocalChecked());
+  } else if (event.tail == TAIL_RELOAD) {
+    Nan::Set(obj, Nan::New("reload").ToLocalChecked(), Nan::True());
+  }
+  return obj;
+}
+
 #if NODE_VERSION_AT_LEAST(0, 11, 13)
 static void MakeCallbackInMainThread(uv_async_t* handle) {
 #else
 static void MakeCallbackInMainThread(uv_async_t* handle, int status) {
 #endif
   Nan::HandleScope scope;
+  Environment* env = static_cast<Environment*>(handle->data);
 
-  if (!g_callback.IsEmpty()) {
-    Local<String> type;
-    switch (g_type) {
-      case EVENT_CHANGE:
-        type = Nan::New("change").ToLocalChecked();
-        break;
-      case EVENT_DELETE:
-        type = Nan::New("delete").ToLocalChecked();
-        break;
-      case EVENT_RENAME:
-        type = Nan::New("rename").ToLocalChecked();
-        break;
-      case EVENT_CHILD_CREATE:
-        type = Nan::New("child-create").ToLocalChecked();
-        break;
-      case EVENT_CHILD_CHANGE:
-        type = Nan::New("child-change").ToLocalChecked();
-        break;
-      case EVENT_CHILD_DELETE:
-        type = Nan::New("child-delete").ToLocalChecked();
-        break;
-      case EVENT_CHILD_RENAME:
-        type = Nan::New("child-rename").ToLocalChecked();
-        break;
-      default:
-        type = Nan::New("unknown").ToLocalChecked();
-        return;
-    }
+  // Only take what is queued right now, events posted while the callbacks run
+  // will trigger another round.
+  std::vector<WatcherEvent> events;
+  WatcherEvent event;
+  while (events.size() < env->queue.capacity() && env->queue.Pop(&event))
+    events.push_back(std::move(event));
+
+  uint64_t now = uv_hrtime();
+  for (size_t i = 0; i < events.size(); ++i) {
+    CountLatency(events[i].posted_at, now);
+    Count(&g_stats.queue_wait_ns, now - events[i].queued_at);
+  }
 
-    Local<Value> argv[] = {
-        type,
-        WatcherHandleToV8Value(g_handle),
-        Nan::New(g_new_path.data(), g_new_path.size()).ToLocalChecked(),
-        Nan::New(g_old_path.data(), g_old_path.size()).ToLocalChecked(),
-    };
-    Local<v8::Context> context = Nan::GetCurrentContext();
-    Nan::New(g_callback)->Call(context, context->Global(), 4, argv).ToLocalChecked();
+  if (env->overflowed.exchange(false)) {
+    std::vector<WatcherHandle> handles = env->registry.Handles();
+    for (size_t i = 0; i < handles.size(); ++i) {
+      WatcherEvent rescan = { EVENT_RESCAN, handles[i], std::vector<char>(),
+                              std::vector<char>(), 1, EventStat(), 0,
+                              TAIL_NONE, std::string(), now };
+      events.push_back(rescan);
+    }
   }
 
-  WakeupNewThread();
+  if (events.empty())
+    return;
+  Count(&g_stats.delivered, events.size());
+
+  if (!env->batch_callback.IsEmpty()) {
+    Local<Array> batch = Nan::New<Array>(events.size());
+    for (size_t i = 0; i < events.size(); ++i)
+      Nan::Set(batch, i, EventToV8Value(events[i]));
+
+    Local<Value> argv[] = { batch };
+    env->async_resource->runInAsyncScope(Nan::GetCurrentContext()->Global(),
+                                         Nan::New(env->batch_callback), 1, argv);
+  } else if (!env->callback.IsEmpty()) {
+    // Compatibility path for the single event callback.
+    for (size_t i = 0; i < events.size(); ++i) {
+      const WatcherEvent& e = events[i];
+      Local<Value> argv[] = {
+          EventTypeToV8Value(e.type),
+          WatcherHandleToV8Value(e.handle),
+          Nan::New(e.new_path.data(), e.new_path.size()).ToLocalChecked(),
+          Nan::New(e.old_path.data(), e.old_path.size()).ToLocalChecked(),
+      };
+      env->async_resource->runInAsyncScope(Nan::GetCurrentContext()->Global(),
+                                           Nan::New(env->callback), 4, argv);
+    }
+  }
 }
 
-static void SetRef(bool value) {
-  uv_handle_t* h = reinterpret_cast<uv_handle_t*>(&g_async);
+static void SetRef(Environment* env, bool value) {
+  uv_handle_t* h = reinterpret_cast<uv_handle_t*>(&env->async);
   if (value) {
     uv_ref(h);
   } else {
@@ -74,36 +414,503 @@ static void SetRef(bool value) {
   }
 }
 
-void CommonInit() {
+// The watcher threads run until the process exits, so the module must stay
+// mapped even once every environment that loaded it is gone and Node closes
+// it. Taking a reference of our own that is never released keeps it loaded.
+static void PinModule() {
+#ifdef _WIN32
+  HMODULE module;
+  GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS |
+                         GET_MODULE_HANDLE_EX_FLAG_PIN,
+                     reinterpret_cast<LPCWSTR>(&PinModule),
+                     &module);
+#else
+  Dl_info info;
+  if (dladdr(reinterpret_cast<void*>(&PinModule), &info) != 0 &&
+      info.dli_fname != NULL)
+    dlopen(info.dli_fname, RTLD_LAZY | RTLD_NODELETE);
+#endif
+}
+
+static void InitWatcherThread() {
+  PinModule();
+  g_coalescer = new EventCoalescer();
+  g_owners = new std::unordered_map<WatcherHandle, Environment*>();
+  g_held = new std::unordered_map<WatcherHandle, std::vector<WatcherEvent> >();
+  uv_mutex_init(&g_owners_mutex);
+  g_watched = new std::unordered_map<WatcherHandle, WatchedPath>();
+  g_unregistered = new std::vector<UnregisteredEvent>();
+  uv_mutex_init(&g_watched_mutex);
+
   uv_sem_init(&g_semaphore, 0);
-  uv_async_init(uv_default_loop(), &g_async, MakeCallbackInMainThread);
+  PlatformInit();
+  uv_thread_create(&g_thread, &CommonThread, NULL);
+}
+
+// Stops watching everything the environment watched and detaches it from the
+// watcher thread.
+static void CleanupEnvironment(Environment* env) {
+  std::vector<WatcherHandle> handles = env->registry.Handles();
+  {
+    ScopedLocker locker(g_owners_mutex);
+    for (size_t i = 0; i < handles.size(); ++i)
+      g_owners->erase(handles[i]);
+  }
+
+  for (size_t i = 0; i < handles.size(); ++i) {
+    PlatformUnwatch(handles[i]);
+    g_coalescer->RemoveHandle(handles[i]);
+    RemoveWatchedPath(handles[i]);
+  }
+
+  env->callback.Reset();
+  env->batch_callback.Reset();
+  delete env->async_resource;
+  env->async_resource = NULL;
+#ifdef _WIN32
+  PlatformCleanupEnvironment();
+#endif
+}
+
+static void OnEnvironmentClosed(uv_handle_t* handle) {
+  Environment* env = static_cast<Environment*>(handle->data);
+#if NODE_VERSION_AT_LEAST(14, 8, 0)
+  env->cleanup_done(env->cleanup_done_arg);
+#endif
+  delete env;
+}
+
+static void CloseEnvironment(Environment* env) {
+  uv_close(reinterpret_cast<uv_handle_t*>(&env->async), OnEnvironmentClosed);
+}
+
+#if NODE_VERSION_AT_LEAST(14, 8, 0)
+// Runs when the environment is torn down, for workers as well as for the main
+// thread at exit. The uv_async_t has to be closed before the loop goes away,
+// so the hook only reports being done from the close callback.
+static void EnvironmentCleanupHook(void* arg, void (*done)(void*), void* done_arg) {
+  Environment* env = static_cast<Environment*>(arg);
+  CleanupEnvironment(env);
+  env->closing = true;
+  env->cleanup_done = done;
+  env->cleanup_done_arg = done_arg;
+  if (env->pending_watches == 0)
+    CloseEnvironment(env);
+}
+#endif
+
+Local<Value> CommonInit() {
+  uv_once(&g_init_once, InitWatcherThread);
+
+  Environment* env = new Environment();
+  env->async.data = env;
+  uv_async_init(Nan::GetCurrentEventLoop(), &env->async, MakeCallbackInMainThread);
   // As long as any uv_ref'd uv_async_t handle remains active, the node
   // process will never exit, so we must call uv_unref here (#47).
-  SetRef(false);
-  g_watch_count = 0;
-  uv_thread_create(&g_thread, &CommonThread, NULL);
+  SetRef(env, false);
+#ifdef _WIN32
+  PlatformInitEnvironment();
+#endif
+
+#if NODE_VERSION_AT_LEAST(14, 8, 0)
+  env->cleanup_hook = node::AddEnvironmentCleanupHook(
+      v8::Isolate::GetCurrent(), EnvironmentCleanupHook, env);
+#endif
+
+  return Nan::New<External>(env);
 }
 
 void WaitForMainThread() {
   uv_sem_wait(&g_semaphore);
 }
 
+void CountKernelEvents(size_t events, size_t bytes) {
+  Count(&g_stats.kernel_events, events);
+  Count(&g_stats.kernel_bytes, bytes);
+}
+
 void WakeupNewThread() {
   uv_sem_post(&g_semaphore);
 }
 
-void PostEventAndWait(EVENT_TYPE type,
+static void CountDropped(Environment* env) {
+  env->dropped_count.fetch_add(1, std::memory_order_relaxed);
+  Count(&g_stats.dropped);
+  if (!env->overflowed.exchange(true))
+    Count(&g_stats.overflows);
+}
+
+static void DeliverEvent(Environment* env, WatcherEvent* event) {
+  event->queued_at = uv_hrtime();
+  env->journal.Append(*event);
+  if (!env->queue.Push(std::move(*event)))
+    CountDropped(env);
+}
+
+// Hands the events to the environments owning their handles. Events of
+// handles that were unwatched meanwhile are dropped.
+static void QueueEvents(std::vector<WatcherEvent>* events) {
+  if (events->empty())
+    return;
+
+  ScopedLocker locker(g_owners_mutex);
+  Environment* last = NULL;
+  std::unordered_map<WatcherHandle, Environment*>::const_iterator owner;
+  for (size_t i = 0; i < events->size(); ++i) {
+    WatcherEvent& event = (*events)[i];
+    owner = g_owners->find(event.handle);
+    if (owner == g_owners->end())
+      continue;
+
+    Environment* env = owner->second;
+    if (!g_held->empty()) {
+      std::unordered_map<WatcherHandle, std::vector<WatcherEvent> >::iterator held =
+          g_held->find(event.handle);
+      if (held != g_held->end()) {
+        if (held->second.size() < env->queue.capacity())
+          held->second.push_back(std::move(event));
+        else
+          CountDropped(env);
+        continue;
+      }
+    }
+
+    DeliverEvent(env, &event);
+
+    // Sends are coalesced by libuv, so a burst of events results in a single
+    // callback on the JS thread.
+    if (env != last) {
+      uv_async_send(&env->async);
+      last = env;
+    }
+  }
+}
+
+// Returns |path| relative to the watched path, with '/' as separator.
+static std::string RelativePath(const std::vector<char>& path,
+                                size_t root_length) {
+  if (path.size() <= root_length)
+    return std::string();
+
+  std::string relative(path.begin() + root_length, path.end());
+#ifdef _WIN32
+  std::replace(relative.begin(), relative.end(), '\\', '/');
+#endif
+  size_t start = relative.find_first_not_of('/');
+  return start == std::string::npos ? std::string() : relative.substr(start);
+}
+
+static bool IsEventFiltered(EVENT_TYPE type,
+                            WatcherHandle handle,
+                            const std::vector<char>& new_path,
+                            const std::vector<char>& old_path) {
+  if (type == EVENT_RESCAN || g_filter_count.load() == 0)
+    return false;
+
+  ScopedLocker locker(g_watched_mutex);
+  std::unordered_map<WatcherHandle, WatchedPath>::const_iterator iter =
+      g_watched->find(handle);
+  if (iter == g_watched->end() || !iter->second.filter)
+    return false;
+
+  const WatchedPath& entry = iter->second;
+  size_t root_length = entry.path.size();
+  if (entry.filter->AcceptsEvent(type, RelativePath(new_path, root_length)))
+    return false;
+  // A rename out of the filtered paths still has to be reported.
+  return old_path.empty() ||
+      !entry.filter->AcceptsEvent(type, RelativePath(old_path, root_length));
+}
+
+// Drops the cached digests of the paths an event is about, events of the
+// watched path itself carry no path.
+static void InvalidateDigests(WatcherHandle handle,
+                              const std::vector<char>& new_path,
+                              const std::vector<char>& old_path) {
+  if (!HasCachedDigests())
+    return;
+
+  if (new_path.empty()) {
+    ScopedLocker locker(g_watched_mutex);
+    std::unordered_map<WatcherHandle, WatchedPath>::const_iterator iter =
+        g_watched->find(handle);
+    if (iter != g_watched->end())
+      InvalidateDigest(iter->second.path);
+  } else {
+    InvalidateDigest(std::string(new_path.begin(), new_path.end()));
+  }
+  if (!old_path.empty())
+    InvalidateDigest(std::string(old_path.begin(), old_path.end()));
+}
+
+static bool IsContentUnchanged(const TrackedStat& last,
+                               const TrackedStat& current,
+                               bool attributes_only) {
+  if (last.stat.ino != current.stat.ino || last.stat.size != current.stat.size)
+    return false;
+  // The backend saw no write, only the size could tell a truncation apart.
+  if (attributes_only)
+    return true;
+  return last.stat.mtime_ns == current.stat.mtime_ns &&
+      last.stat.mtime_ns + kRacyTimestampNs <= last.taken_ns;
+}
+
+// Attaches the stat of the event's path for watches with the stat option.
+// Returns false for a change that left the size, inode and mtime of the path
+// as they were when it was last seen.
+static bool StatEvent(WatcherEvent* event, bool attributes_only) {
+  if (g_stat_count.load() == 0 || event->type == EVENT_RESCAN)
+    return true;
+
+  std::string path;
+  {
+    ScopedLocker locker(g_watched_mutex);
+    std::unordered_map<WatcherHandle, WatchedPath>::iterator iter =
+        g_watched->find(event->handle);
+    if (iter == g_watched->end() || !iter->second.stat)
+      return true;
+
+    WatchedPath& entry = iter->second;
+    path = event->new_path.empty() ?
+        entry.path : std::string(event->new_path.begin(), event->new_path.end());
+    if (!event->old_path.empty())
+      entry.stats.erase(std::string(event->old_path.begin(), event->old_path.end()));
+    if (event->type == EVENT_DELETE || event->type == EVENT_CHILD_DELETE) {
+      entry.stats.erase(path);
+      return true;
+    }
+  }
+
+  TrackedStat current;
+  if (!StatPath(path, &current))
+    return true;
+  event->stat = current.stat;
+
+  ScopedLocker locker(g_watched_mutex);
+  std::unordered_map<WatcherHandle, WatchedPath>::iterator iter =
+      g_watched->find(event->handle);
+  if (iter == g_watched->end())
+    return true;
+
+  std::unordered_map<std::string, TrackedStat>& stats = iter->second.stats;
+  std::unordered_map<std::string, TrackedStat>::iterator last = stats.find(path);
+  bool unchanged = last != stats.end() &&
+      IsContentUnchanged(last->second, current, attributes_only);
+  if (last != stats.end()) {
+    last->second = current;
+  } else {
+    if (stats.size() >= kMaxTrackedStats)
+      stats.clear();
+    stats[path] = current;
+  }
+
+  return !unchanged ||
+      (event->type != EVENT_CHANGE && event->type != EVENT_CHILD_CHANGE);
+}
+
+static void SetTailPosition(WatcherHandle handle,
+                            const std::string& path,
+                            const TailPosition& position) {
+  ScopedLocker locker(g_watched_mutex);
+  std::unordered_map<WatcherHandle, WatchedPath>::iterator iter =
+      g_watched->find(handle);
+  if (iter == g_watched->end())
+    return;
+
+  std::unordered_map<std::string, TailPosition>& tails = iter->second.tails;
+  if (tails.size() >= kMaxTrackedStats && tails.find(path) == tails.end())
+    tails.clear();
+  tails[path] = position;
+}
+
+// Reads what was appended to the changed file for watches with the tail
+// option. Files are followed from where they ended when the watch started,
+// children created later from their start, and others ask for a reload the
+// first time they change.
+static void TailEvent(WatcherEvent* event) {
+  if (g_tail_count.load() == 0 || event->type == EVENT_RESCAN)
+    return;
+
+  std::string path;
+  TailPosition position = { 0, 0 };
+  bool followed = false;
+  {
+    ScopedLocker locker(g_watched_mutex);
+    std::unordered_map<WatcherHandle, WatchedPath>::iterator iter =
+        g_watched->find(event->handle);
+    if (iter == g_watched->end() || !iter->second.tail)
+      return;
+
+    WatchedPath& entry = iter->second;
+    path = event->new_path.empty() ?
+        entry.path : std::string(event->new_path.begin(), event->new_path.end());
+    std::unordered_map<std::string, TailPosition>& tails = entry.tails;
+    if (!event->old_path.empty()) {
+      // A renamed file keeps its contents, and so where it was read up to.
+      std::unordered_map<std::string, TailPosition>::iterator old =
+          tails.find(std::string(event->old_path.begin(), event->old_path.end()));
+      if (old != tails.end()) {
+        tails[path] = old->second;
+        tails.erase(old);
+      }
+      return;
+    }
+    if (event->type == EVENT_DELETE || event->type == EVENT_CHILD_DELETE) {
+      tails.erase(path);
+      return;
+    }
+
+    std::unordered_map<std::string, TailPosition>::const_iterator last =
+        tails.find(path);
+    if (last != tails.end()) {
+      position = last->second;
+      followed = true;
+    }
+  }
+
+  if (event->type == EVENT_CHILD_CREATE) {
+    if (GetTailPosition(path, &position) == 0) {
+      position.offset = 0;
+      SetTailPosition(event->handle, path, position);
+    }
+    return;
+  }
+  if (event->type != EVENT_CHANGE && event->type != EVENT_CHILD_CHANGE &&
+      event->type != EVENT_RESURRECT)
+    return;
+
+  if (!followed) {
+    if (GetTailPosition(path, &position) == 0) {
+      event->tail = TAIL_RELOAD;
+      SetTailPosition(event->handle, path, position);
+    }
+    return;
+  }
+
+  bool reload = false;
+  if (ReadAppended(path, kMaxTailSize, &position, &event->appended, &reload) < 0)
+    return;
+  if (reload)
+    event->tail = TAIL_RELOAD;
+  else if (!event->appended.empty())
+    event->tail = TAIL_APPENDED;
+  SetTailPosition(event->handle, path, position);
+}
+
+// Takes the stat and the tail of |event|, returns false when it turns out to
+// change nothing.
+static bool ReadEventFile(WatcherEvent* event, bool attributes_only) {
+  if (!StatEvent(event, attributes_only)) {
+    Count(&g_stats.suppressed);
+    return false;
+  }
+  TailEvent(event);
+  return true;
+}
+
+// Keeps the event of a handle that is not known yet while watches are being
+// added, as it may be the one PlatformWatch is about to return.
+static bool StashUnregisteredEvent(EVENT_TYPE type,
+                                   WatcherHandle handle,
+                                   const std::vector<char>& new_path,
+                                   const std::vector<char>& old_path,
+                                   bool attributes_only) {
+  if (g_registering.load() == 0)
+    return false;
+
+  ScopedLocker locker(g_watched_mutex);
+  if (g_registering.load() == 0 || g_watched->find(handle) != g_watched->end())
+    return false;
+
+  if (g_unregistered->size() >= kEventQueueCapacity) {
+    Count(&g_stats.dropped);
+    return true;
+  }
+  UnregisteredEvent event = { type, handle, new_path, old_path, attributes_only };
+  g_unregistered->push_back(std::move(event));
+  return true;
+}
+
+static void PostEvent(EVENT_TYPE type,
                       WatcherHandle handle,
                       const std::vector<char>& new_path,
-                      const std::vector<char>& old_path) {
-  // FIXME should not pass args by settings globals.
-  g_type = type;
-  g_handle = handle;
-  g_new_path = new_path;
-  g_old_path = old_path;
-
-  uv_async_send(&g_async);
-  WaitForMainThread();
+                      const std::vector<char>& old_path,
+                      bool attributes_only) {
+  if (StashUnregisteredEvent(type, handle, new_path, old_path, attributes_only))
+    return;
+  if (IsEventFiltered(type, handle, new_path, old_path)) {
+    Count(&g_stats.filtered);
+    return;
+  }
+  InvalidateDigests(handle, new_path, old_path);
+
+  WatcherEvent event = { type, handle, new_path, old_path, 1, EventStat(),
+                         uv_hrtime(), TAIL_NONE, std::string(), 0 };
+  if (ScopedEventBatch::Defer(&event, attributes_only) ||
+      !ReadEventFile(&event, attributes_only))
+    return;
+
+  std::vector<WatcherEvent> ready;
+  g_coalescer->Add(&event, &ready);
+  QueueEvents(&ready);
+}
+
+void PostEvent(EVENT_TYPE type,
+               WatcherHandle handle,
+               const std::vector<char>& new_path,
+               const std::vector<char>& old_path) {
+  PostEvent(type, handle, new_path, old_path, false);
+}
+
+void PostAttributeEvent(EVENT_TYPE type,
+                        WatcherHandle handle,
+                        const std::vector<char>& path) {
+  PostEvent(type, handle, path, std::vector<char>(), true);
+}
+
+static thread_local ScopedEventBatch* t_event_batch;
+
+ScopedEventBatch::ScopedEventBatch() : outermost_(t_event_batch == NULL) {
+  if (outermost_)
+    t_event_batch = this;
+}
+
+ScopedEventBatch::~ScopedEventBatch() {
+  if (!outermost_)
+    return;
+  t_event_batch = NULL;
+
+  std::vector<WatcherEvent> ready;
+  for (size_t i = 0; i < events_.size(); ++i) {
+    DeferredEvent& deferred = events_[i];
+    if (ReadEventFile(&deferred.event, deferred.attributes_only))
+      g_coalescer->Add(&deferred.event, &ready);
+  }
+  QueueEvents(&ready);
+}
+
+// static
+bool ScopedEventBatch::Defer(WatcherEvent* event, bool attributes_only) {
+  if (t_event_batch == NULL)
+    return false;
+  DeferredEvent deferred = { std::move(*event), attributes_only };
+  t_event_batch->events_.push_back(std::move(deferred));
+  return true;
+}
+
+void FlushPendingEvents() {
+  std::vector<WatcherEvent> ready;
+  g_coalescer->Flush(&ready);
+  QueueEvents(&ready);
+}
+
+int PendingEventsTimeout() {
+  return g_coalescer->Timeout();
+}
+
+static void InitAsyncResource(Environment* env) {
+  if (env->async_resource == NULL)
+    env->async_resource = new Nan::AsyncResource("pathwatcher:event");
 }
 
 NAN_METHOD(SetCallback) {
@@ -112,58 +919,1274 @@ NAN_METHOD(SetCallback) {
   if (!info[0]->IsFunction())
     return Nan::ThrowTypeError("Function required");
 
-  g_callback.Reset(Local<Function>::Cast(info[0]));
+  Environment* env = GetEnvironment(info);
+  InitAsyncResource(env);
+  env->callback.Reset(Local<Function>::Cast(info[0]));
   return;
 }
 
-NAN_METHOD(Watch) {
+NAN_METHOD(SetBatchCallback) {
   Nan::HandleScope scope;
 
-  if (!info[0]->IsString())
-    return Nan::ThrowTypeError("String required");
+  if (!info[0]->IsFunction())
+    return Nan::ThrowTypeError("Function required");
+
+  Environment* env = GetEnvironment(info);
+  InitAsyncResource(env);
+  env->batch_callback.Reset(Local<Function>::Cast(info[0]));
+  return;
+}
+
+static bool EventTypeFromString(const std::string& name, EVENT_TYPE* type) {
+  for (int i = EVENT_NONE + 1; i <= EVENT_RESURRECT; ++i) {
+    if (name == EventTypeToString(static_cast<EVENT_TYPE>(i))) {
+      *type = static_cast<EVENT_TYPE>(i);
+      return true;
+    }
+  }
+  return false;
+}
+
+static std::vector<std::string> ToStringVector(Local<Value> value) {
+  std::vector<std::string> strings;
+  if (!value->IsArray())
+    return strings;
+
+  Local<Array> array = value.As<Array>();
+  for (uint32_t i = 0; i < array->Length(); ++i) {
+    Local<Value> item = Nan::Get(array, i).ToLocalChecked();
+    if (item->IsString())
+      strings.push_back(*String::Utf8Value(v8::Isolate::GetCurrent(), item));
+  }
+  return strings;
+}
+
+static void ParseWatchOptions(Local<Object> obj, WatchOptions* options) {
+  Local<Value> recursive =
+      Nan::Get(obj, Nan::New("recursive").ToLocalChecked()).ToLocalChecked();
+  options->recursive = Nan::To<bool>(recursive).FromJust();
+
+  Local<Value> coalesce =
+      Nan::Get(obj, Nan::New("coalesce").ToLocalChecked()).ToLocalChecked();
+  if (coalesce->IsNumber())
+    options->coalesce_ms = Nan::To<int32_t>(coalesce).FromJust();
+
+  Local<Value> resurrect =
+      Nan::Get(obj, Nan::New("resurrect").ToLocalChecked()).ToLocalChecked();
+  options->resurrect = Nan::To<bool>(resurrect).FromJust();
+
+  Local<Value> stat =
+      Nan::Get(obj, Nan::New("stat").ToLocalChecked()).ToLocalChecked();
+  options->stat = Nan::To<bool>(stat).FromJust();
+
+  Local<Value> poll =
+      Nan::Get(obj, Nan::New("poll").ToLocalChecked()).ToLocalChecked();
+  options->poll = Nan::To<bool>(poll).FromJust();
+
+  Local<Value> tail =
+      Nan::Get(obj, Nan::New("tail").ToLocalChecked()).ToLocalChecked();
+  options->tail = Nan::To<bool>(tail).FromJust();
+
+  Local<Value> blocks =
+      Nan::Get(obj, Nan::New("blocks").ToLocalChecked()).ToLocalChecked();
+  if (blocks->IsUint32())
+    options->block_size = Nan::To<uint32_t>(blocks).FromJust();
+
+  std::vector<std::string> include = ToStringVector(
+      Nan::Get(obj, Nan::New("include").ToLocalChecked()).ToLocalChecked());
+  std::vector<std::string> exclude = ToStringVector(
+      Nan::Get(obj, Nan::New("exclude").ToLocalChecked()).ToLocalChecked());
+  Local<Value> events =
+      Nan::Get(obj, Nan::New("events").ToLocalChecked()).ToLocalChecked();
+  Local<Value> ignore_attributes =
+      Nan::Get(obj, Nan::New("ignoreAttributes").ToLocalChecked()).ToLocalChecked();
+
+  uint32_t event_mask = ~0u;
+  if (events->IsArray()) {
+    std::vector<std::string> names = ToStringVector(events);
+    event_mask = 0;
+    for (size_t i = 0; i < names.size(); ++i) {
+      EVENT_TYPE type;
+      if (EventTypeFromString(names[i], &type))
+        event_mask |= 1u << type;
+    }
+  }
+
+  bool ignores_attributes = Nan::To<bool>(ignore_attributes).FromJust();
+  if (!include.empty() || !exclude.empty() || event_mask != ~0u || ignores_attributes)
+    options->filter.reset(new PathFilter(include, exclude, event_mask, ignores_attributes));
+}
+
+NAN_METHOD(EnableJournal) {
+  Nan::HandleScope scope;
+
+  if (!info[0]->IsNumber())
+    return Nan::ThrowTypeError("Number required");
+
+  double capacity = info[0]->NumberValue(Nan::GetCurrentContext()).FromJust();
+  GetEnvironment(info)->journal.SetCapacity(capacity > 0 ? static_cast<size_t>(capacity) : 0);
+  return;
+}
+
+// Returns {gap, sequence, events}. |sequence| is the one to pass next time:
+// that of the last event returned, or the newest one when there is a gap and
+// the watched paths have to be read again.
+NAN_METHOD(ChangesSince) {
+  Nan::HandleScope scope;
+
+  if (!info[0]->IsNumber() || !info[1]->IsNumber())
+    return Nan::ThrowTypeError("Number required");
+
+  double sequence_arg = info[0]->NumberValue(Nan::GetCurrentContext()).FromJust();
+  double max_count = info[1]->NumberValue(Nan::GetCurrentContext()).FromJust();
+  uint64_t sequence = sequence_arg > 0 ? static_cast<uint64_t>(sequence_arg) : 0;
+  std::vector<JournalEntry> entries;
+  uint64_t last;
+  bool complete = GetEnvironment(info)->journal.Since(
+      sequence, max_count > 0 ? static_cast<size_t>(max_count) : 0,
+      &entries, &last);
+
+  Local<Array> events = Nan::New<Array>(entries.size());
+  for (size_t i = 0; i < entries.size(); ++i) {
+    Local<Object> obj = EventToV8Value(entries[i].event);
+    Nan::Set(obj, Nan::New("sequence").ToLocalChecked(),
+             Nan::New<Number>(static_cast<double>(entries[i].sequence)));
+    Nan::Set(obj, Nan::New("time").ToLocalChecked(),
+             Nan::New<Number>(entries[i].time));
+    Nan::Set(events, i, obj);
+  }
+
+  uint64_t next;
+  if (!complete)
+    next = last;
+  else if (!entries.empty())
+    next = entries.back().sequence;
+  else
+    next = std::min(sequence, last);
+  Local<Object> result = Nan::New<Object>();
+  Nan::Set(result, Nan::New("gap").ToLocalChecked(), Nan::New(!complete));
+  Nan::Set(result, Nan::New("sequence").ToLocalChecked(),
+           Nan::New<Number>(static_cast<double>(next)));
+  Nan::Set(result, Nan::New("events").ToLocalChecked(), events);
+  info.GetReturnValue().Set(result);
+}
+
+NAN_METHOD(SetCoalesceWindow) {
+  Nan::HandleScope scope;
+
+  if (!info[0]->IsNumber())
+    return Nan::ThrowTypeError("Number required");
 
+  Environment* env = GetEnvironment(info);
+  env->default_coalesce_ms = std::max(Nan::To<int32_t>(info[0]).FromJust(), 0);
+  for (std::set<WatcherHandle>::const_iterator iter =
+           env->default_window_handles.begin();
+       iter != env->default_window_handles.end();
+       ++iter)
+    g_coalescer->SetWindow(*iter, env->default_coalesce_ms);
+  return;
+}
+
+static Local<Value> ErrorToV8Value(const char* message, int error_number) {
   Local<v8::Context> context = Nan::GetCurrentContext();
-  Local<String> path = info[0]->ToString(context).ToLocalChecked();
-  WatcherHandle handle = PlatformWatch(*String::Utf8Value(v8::Isolate::GetCurrent(), path));
-  if (!PlatformIsHandleValid(handle)) {
-    int error_number = PlatformInvalidHandleToErrorNumber(handle);
-    v8::Local<v8::Value> err =
-      v8::Exception::Error(Nan::New<v8::String>("Unable to watch path").ToLocalChecked());
-    v8::Local<v8::Object> err_obj = err.As<v8::Object>();
-    if (error_number != 0) {
-      err_obj->Set(context,
-                   Nan::New<v8::String>("errno").ToLocalChecked(),
-                   Nan::New<v8::Integer>(error_number)).FromJust();
+  v8::Local<v8::Value> err =
+    v8::Exception::Error(Nan::New<v8::String>(message).ToLocalChecked());
+  v8::Local<v8::Object> err_obj = err.As<v8::Object>();
+  if (error_number != 0) {
+    err_obj->Set(context,
+                 Nan::New<v8::String>("errno").ToLocalChecked(),
+                 Nan::New<v8::Integer>(error_number)).FromJust();
 #if NODE_VERSION_AT_LEAST(0, 11, 5)
-      // Node 0.11.5 is the first version to contain libuv v0.11.6, which
-      // contains https://github.com/libuv/libuv/commit/3ee4d3f183 which changes
-      // uv_err_name from taking a struct uv_err_t (whose uv_err_code `code` is
-      // a difficult-to-produce uv-specific errno) to just take an int which is
-      // a negative errno.
-      err_obj->Set(context,
-                   Nan::New<v8::String>("code").ToLocalChecked(),
-                   Nan::New<v8::String>(uv_err_name(-error_number)).ToLocalChecked()).FromJust();
+    // Node 0.11.5 is the first version to contain libuv v0.11.6, which
+    // contains https://github.com/libuv/libuv/commit/3ee4d3f183 which changes
+    // uv_err_name from taking a struct uv_err_t (whose uv_err_code `code` is
+    // a difficult-to-produce uv-specific errno) to just take an int which is
+    // a negative errno.
+    err_obj->Set(context,
+                 Nan::New<v8::String>("code").ToLocalChecked(),
+                 Nan::New<v8::String>(uv_err_name(-error_number)).ToLocalChecked()).FromJust();
 #endif
+  }
+  return err;
+}
+
+static Local<Value> WatchErrorToV8Value(int error_number) {
+  return ErrorToV8Value("Unable to watch path", error_number);
+}
+
+// Starts watching |path| for |env| and routes the events of the handle to it,
+// including those posted before PlatformWatch returned. Does not touch the
+// state of the environment, so that it can run on the threadpool, with
+// |hold_events| keeping the events from the environment until
+// RegisterWatch. |window_ms| is the coalesce window of the handle.
+static WatcherHandle StartWatch(Environment* env,
+                                const std::string& path,
+                                const WatchOptions& options,
+                                int window_ms,
+                                bool hold_events) {
+  WatchBaseline baseline;
+  TakeWatchBaseline(path, options, &baseline);
+
+  {
+    ScopedLocker locker(g_watched_mutex);
+    ++g_registering;
+  }
+  WatcherHandle handle = PlatformWatch(path.c_str(), options);
+  if (PlatformIsHandleValid(handle)) {
+    {
+      ScopedLocker locker(g_owners_mutex);
+      (*g_owners)[handle] = env;
+      if (hold_events)
+        (*g_held)[handle].clear();
+    }
+    g_coalescer->SetWindow(handle, window_ms);
+
+    std::vector<UnregisteredEvent> stashed;
+    SetWatchedPath(handle, path, options, baseline, &stashed);
+    for (size_t i = 0; i < stashed.size(); ++i) {
+      const UnregisteredEvent& event = stashed[i];
+      PostEvent(event.type, event.handle, event.new_path, event.old_path,
+                event.attributes_only);
     }
-    return Nan::ThrowError(err);
   }
 
-  if (g_watch_count++ == 0)
-    SetRef(true);
+  ScopedLocker locker(g_watched_mutex);
+  if (--g_registering == 0)
+    g_unregistered->clear();
+  return handle;
+}
 
-  info.GetReturnValue().Set(WatcherHandleToV8Value(handle));
+// Stops a handle returned by StartWatch, dropping the events it still holds.
+static void StopWatch(WatcherHandle handle) {
+  {
+    ScopedLocker locker(g_owners_mutex);
+    g_owners->erase(handle);
+    g_held->erase(handle);
+  }
+
+  PlatformUnwatch(handle);
+  g_coalescer->RemoveHandle(handle);
+  RemoveWatchedPath(handle);
 }
 
-NAN_METHOD(Unwatch) {
-  Nan::HandleScope scope;
+// Makes a handle returned by StartWatch known to the environment.
+static void RegisterWatch(Environment* env,
+                          const std::string& key,
+                          WatcherHandle handle,
+                          const WatchOptions& options) {
+  env->registry.Add(key, handle);
+  if (options.coalesce_ms < 0) {
+    env->default_window_handles.insert(handle);
+    // The default may have changed while the watch was added.
+    g_coalescer->SetWindow(handle, env->default_coalesce_ms);
+  }
+  if (env->registry.size() == 1)
+    SetRef(env, true);
+}
 
-  if (!IsV8ValueWatcherHandle(info[0]))
-    return Nan::ThrowTypeError("Local type required");
+// Hands the environment the events held for a handle started on the
+// threadpool, once JS knows the handle.
+static void ReleaseHeldEvents(Environment* env, WatcherHandle handle) {
+  ScopedLocker locker(g_owners_mutex);
+  std::unordered_map<WatcherHandle, std::vector<WatcherEvent> >::iterator held =
+      g_held->find(handle);
+  if (held == g_held->end())
+    return;
+
+  std::vector<WatcherEvent> events;
+  events.swap(held->second);
+  g_held->erase(held);
+  for (size_t i = 0; i < events.size(); ++i)
+    DeliverEvent(env, &events[i]);
+  if (!events.empty())
+    uv_async_send(&env->async);
+}
 
-  PlatformUnwatch(V8ValueToWatcherHandle(info[0]));
+static int WindowFor(Environment* env, const WatchOptions& options) {
+  return options.coalesce_ms < 0 ? env->default_coalesce_ms : options.coalesce_ms;
+}
 
-  if (--g_watch_count == 0)
-    SetRef(false);
+// Block hashes are kept for files only. Returns 0 or a negative libuv error
+// code, a path that can not be stat'ed is left for PlatformWatch to fail on.
+static int CheckWatchOptions(const char* path, const WatchOptions& options) {
+  if (options.block_size == 0)
+    return 0;
 
-  return;
+  uv_fs_t req;
+  int r = uv_fs_stat(NULL, &req, path, NULL);
+  bool is_directory = r == 0 && (req.statbuf.st_mode & S_IFMT) == S_IFDIR;
+  uv_fs_req_cleanup(&req);
+  return is_directory ? UV_EISDIR : 0;
+}
+
+// Watches |path|, or takes another reference on the handle already watching
+// it with the same options.
+static WatcherHandle AddWatch(Environment* env,
+                              const char* path,
+                              const WatchOptions& options) {
+  std::string key = WatchRegistry::MakeKey(path, options);
+  WatcherHandle handle;
+  if (env->registry.Acquire(key, &handle))
+    return handle;
+
+  handle = StartWatch(env, path, options, WindowFor(env, options), false);
+  if (PlatformIsHandleValid(handle))
+    RegisterWatch(env, key, handle, options);
+  return handle;
+}
+
+static void RemoveWatch(Environment* env, WatcherHandle handle) {
+  if (!env->registry.Release(handle))
+    return;
+
+  StopWatch(handle);
+  env->default_window_handles.erase(handle);
+  if (env->registry.size() == 0)
+    SetRef(env, false);
+}
+
+NAN_METHOD(Watch) {
+  Nan::HandleScope scope;
+
+  if (!info[0]->IsString())
+    return Nan::ThrowTypeError("String required");
+
+  WatchOptions options;
+  if (info[1]->IsObject())
+    ParseWatchOptions(info[1].As<Object>(), &options);
+
+  Local<v8::Context> context = Nan::GetCurrentContext();
+  String::Utf8Value path(v8::Isolate::GetCurrent(),
+                         info[0]->ToString(context).ToLocalChecked());
+  int error = CheckWatchOptions(*path, options);
+  if (error < 0)
+    return Nan::ThrowError(WatchErrorToV8Value(-error));
+
+  WatcherHandle handle = AddWatch(GetEnvironment(info), *path, options);
+  if (!PlatformIsHandleValid(handle))
+    return Nan::ThrowError(WatchErrorToV8Value(PlatformInvalidHandleToErrorNumber(handle)));
+
+  info.GetReturnValue().Set(WatcherHandleToV8Value(handle));
+}
+
+static Local<Value> ErrorCodeToV8Value(int error_number) {
+  return Nan::New(uv_err_name(-error_number)).ToLocalChecked();
+}
+
+// Watches every path of an array in one call. Returns an array with the
+// handle of each path, or the code of the error that prevented watching it.
+// Options are either one object for all paths or an array of them.
+NAN_METHOD(WatchMany) {
+  Nan::HandleScope scope;
+
+  if (!info[0]->IsArray())
+    return Nan::ThrowTypeError("Array required");
+
+  Environment* env = GetEnvironment(info);
+  v8::Isolate* isolate = v8::Isolate::GetCurrent();
+  Local<Array> paths = info[0].As<Array>();
+  Local<Value> options_arg = info[1];
+  bool options_per_path = options_arg->IsArray();
+
+  uint32_t length = paths->Length();
+  Local<Array> handles = Nan::New<Array>(length);
+  WatchOptions options;
+  Local<Value> parsed_options;
+  for (uint32_t i = 0; i < length; ++i) {
+    Local<Value> path = Nan::Get(paths, i).ToLocalChecked();
+    if (!path->IsString()) {
+      Nan::Set(handles, i, ErrorCodeToV8Value(-UV_EINVAL));
+      continue;
+    }
+
+    // Paths usually share their options object, parse it only once.
+    Local<Value> path_options = options_per_path ?
+        Nan::Get(options_arg.As<Array>(), i).ToLocalChecked() : options_arg;
+    if (parsed_options.IsEmpty() || !path_options->StrictEquals(parsed_options)) {
+      options = WatchOptions();
+      if (path_options->IsObject())
+        ParseWatchOptions(path_options.As<Object>(), &options);
+      parsed_options = path_options;
+    }
+
+    String::Utf8Value path_value(isolate, path);
+    int error = CheckWatchOptions(*path_value, options);
+    if (error < 0) {
+      Nan::Set(handles, i, ErrorCodeToV8Value(-error));
+      continue;
+    }
+
+    WatcherHandle handle = AddWatch(env, *path_value, options);
+    if (PlatformIsHandleValid(handle))
+      Nan::Set(handles, i, WatcherHandleToV8Value(handle));
+    else
+      Nan::Set(handles, i, ErrorCodeToV8Value(PlatformInvalidHandleToErrorNumber(handle)));
+  }
+
+  info.GetReturnValue().Set(handles);
+}
+
+// Adds a watch on the threadpool, so that a slow file system does not block
+// the JS thread. Its events are held from the start, and delivered once the
+// callback has the handle.
+class WatchWorker : public Nan::AsyncWorker {
+ public:
+  WatchWorker(Nan::Callback* callback,
+              Environment* env,
+              const std::string& path,
+              const WatchOptions& options)
+      : Nan::AsyncWorker(callback, "pathwatcher:watch"),
+        env_(env),
+        path_(path),
+        options_(options),
+        window_ms_(WindowFor(env, options)),
+        error_(0),
+        handle_() {
+    ++env_->pending_watches;
+  }
+
+  void Execute() {
+    error_ = CheckWatchOptions(path_.c_str(), options_);
+    if (error_ == 0)
+      handle_ = StartWatch(env_, path_, options_, window_ms_, true);
+  }
+
+  void HandleOKCallback() {
+    Nan::HandleScope scope;
+    --env_->pending_watches;
+    bool valid = error_ == 0 && PlatformIsHandleValid(handle_);
+
+    if (env_->closing) {
+      if (valid)
+        StopWatch(handle_);
+      if (env_->pending_watches == 0)
+        CloseEnvironment(env_);
+      return;
+    }
+
+    if (!valid) {
+      Local<Value> argv[] = {
+        WatchErrorToV8Value(error_ < 0 ? -error_ : PlatformInvalidHandleToErrorNumber(handle_)),
+      };
+      callback->Call(1, argv, async_resource);
+      return;
+    }
+
+    // The path may have been watched while this watch was being added.
+    std::string key = WatchRegistry::MakeKey(path_.c_str(), options_);
+    WatcherHandle existing;
+    if (env_->registry.Acquire(key, &existing)) {
+      StopWatch(handle_);
+      handle_ = existing;
+    } else {
+      RegisterWatch(env_, key, handle_, options_);
+    }
+
+    Local<Value> argv[] = { Nan::Null(), WatcherHandleToV8Value(handle_) };
+    callback->Call(2, argv, async_resource);
+    ReleaseHeldEvents(env_, handle_);
+  }
+
+ private:
+  Environment* env_;
+  std::string path_;
+  WatchOptions options_;
+  int window_ms_;
+  int error_;
+  WatcherHandle handle_;
+};
+
+NAN_METHOD(WatchAsync) {
+  Nan::HandleScope scope;
+
+  if (!info[0]->IsString())
+    return Nan::ThrowTypeError("String required");
+  if (!info[2]->IsFunction())
+    return Nan::ThrowTypeError("Function required");
+
+  WatchOptions options;
+  if (info[1]->IsObject())
+    ParseWatchOptions(info[1].As<Object>(), &options);
+
+  Environment* env = GetEnvironment(info);
+  std::string path = *String::Utf8Value(v8::Isolate::GetCurrent(), info[0]);
+  Nan::Callback* callback = new Nan::Callback(info[2].As<Function>());
+  Nan::AsyncQueueWorker(new WatchWorker(callback, env, path, options));
+}
+
+NAN_METHOD(Unwatch) {
+  Nan::HandleScope scope;
+
+  if (!IsV8ValueWatcherHandle(info[0]))
+    return Nan::ThrowTypeError("Local type required");
+
+  RemoveWatch(GetEnvironment(info), V8ValueToWatcherHandle(info[0]));
+  return;
+}
+
+NAN_METHOD(UnwatchMany) {
+  Nan::HandleScope scope;
+
+  if (!info[0]->IsArray())
+    return Nan::ThrowTypeError("Array required");
+
+  Environment* env = GetEnvironment(info);
+  Local<Array> handles = info[0].As<Array>();
+  uint32_t length = handles->Length();
+  for (uint32_t i = 0; i < length; ++i) {
+    Local<Value> handle = Nan::Get(handles, i).ToLocalChecked();
+    if (IsV8ValueWatcherHandle(handle))
+      RemoveWatch(env, V8ValueToWatcherHandle(handle));
+  }
+  return;
+}
+
+NAN_METHOD(GetWatchLimits) {
+  Nan::HandleScope scope;
+
+  WatchLimits limits;
+  if (!PlatformGetWatchLimits(&limits)) {
+    info.GetReturnValue().Set(Nan::Null());
+    return;
+  }
+
+  Local<Object> obj = Nan::New<Object>();
+  Nan::Set(obj, Nan::New("maxQueuedEvents").ToLocalChecked(),
+           Nan::New<Number>(limits.max_queued_events));
+  Nan::Set(obj, Nan::New("maxUserWatches").ToLocalChecked(),
+           Nan::New<Number>(limits.max_user_watches));
+  Nan::Set(obj, Nan::New("maxUserInstances").ToLocalChecked(),
+           Nan::New<Number>(limits.max_user_instances));
+  Nan::Set(obj, Nan::New("watches").ToLocalChecked(),
+           Nan::New<Number>(limits.watches));
+  Nan::Set(obj, Nan::New("instances").ToLocalChecked(),
+           Nan::New<Number>(limits.instances));
+  Nan::Set(obj, Nan::New("queuedBytes").ToLocalChecked(),
+           Nan::New<Number>(limits.queued_bytes));
+  Nan::Set(obj, Nan::New("watchBudget").ToLocalChecked(),
+           Nan::New<Number>(limits.watch_budget));
+  info.GetReturnValue().Set(obj);
+}
+
+NAN_METHOD(SetWatchBudget) {
+  Nan::HandleScope scope;
+
+  if (!info[0]->IsNumber())
+    return Nan::ThrowTypeError("Number required");
+
+  PlatformSetWatchBudget(
+      static_cast<int64_t>(info[0]->NumberValue(Nan::GetCurrentContext()).FromJust()));
+  return;
+}
+
+NAN_METHOD(GetPolledWatches) {
+  Nan::HandleScope scope;
+
+  std::vector<WatcherHandle> handles;
+  PlatformGetPolledWatches(&handles);
+
+  Local<Array> result = Nan::New<Array>(handles.size());
+  for (size_t i = 0; i < handles.size(); ++i)
+    Nan::Set(result, i, WatcherHandleToV8Value(handles[i]));
+  info.GetReturnValue().Set(result);
+}
+
+NAN_METHOD(SimulateOverflow) {
+  Nan::HandleScope scope;
+  info.GetReturnValue().Set(Nan::New<Boolean>(PlatformSimulateOverflow()));
+}
+
+static void SetCounter(Local<Object> obj, const char* name, const std::atomic<uint64_t>& counter) {
+  Nan::Set(obj, Nan::New(name).ToLocalChecked(),
+           Nan::New<Number>(static_cast<double>(counter.load(std::memory_order_relaxed))));
+}
+
+NAN_METHOD(GetStats) {
+  Nan::HandleScope scope;
+
+  size_t watch_count;
+  {
+    ScopedLocker locker(g_watched_mutex);
+    watch_count = g_watched->size();
+  }
+  std::vector<WatcherHandle> polled;
+  PlatformGetPolledWatches(&polled);
+  size_t polled_count = std::min(polled.size(), watch_count);
+
+  Local<Object> obj = Nan::New<Object>();
+  Local<Object> watches = Nan::New<Object>();
+  Nan::Set(watches, Nan::New(PlatformName()).ToLocalChecked(),
+           Nan::New<Number>(static_cast<double>(watch_count - polled_count)));
+  Nan::Set(watches, Nan::New("polling").ToLocalChecked(),
+           Nan::New<Number>(static_cast<double>(polled_count)));
+  Nan::Set(obj, Nan::New("watches").ToLocalChecked(), watches);
+
+  SetCounter(obj, "kernelEvents", g_stats.kernel_events);
+  SetCounter(obj, "kernelBytes", g_stats.kernel_bytes);
+  SetCounter(obj, "eventsDelivered", g_stats.delivered);
+  SetCounter(obj, "eventsDropped", g_stats.dropped);
+  SetCounter(obj, "eventsFiltered", g_stats.filtered);
+  SetCounter(obj, "eventsSuppressed", g_stats.suppressed);
+  SetCounter(obj, "queueOverflows", g_stats.overflows);
+  Nan::Set(obj, Nan::New("queueWaitMs").ToLocalChecked(),
+           Nan::New<Number>(g_stats.queue_wait_ns.load(std::memory_order_relaxed) / 1e6));
+
+  // Bucket i counts the events delivered in less than 2^i microseconds, and
+  // not less than 2^(i-1).
+  Local<Array> latency = Nan::New<Array>(kLatencyBuckets);
+  for (int i = 0; i < kLatencyBuckets; ++i) {
+    Nan::Set(latency, i, Nan::New<Number>(
+        static_cast<double>(g_stats.latency[i].load(std::memory_order_relaxed))));
+  }
+  Nan::Set(obj, Nan::New("latencyHistogram").ToLocalChecked(), latency);
+
+  info.GetReturnValue().Set(obj);
+}
+
+NAN_METHOD(ResetStats) {
+  Nan::HandleScope scope;
+
+  std::atomic<uint64_t>* counters[] = {
+    &g_stats.kernel_events, &g_stats.kernel_bytes, &g_stats.filtered,
+    &g_stats.suppressed, &g_stats.dropped, &g_stats.overflows,
+    &g_stats.delivered, &g_stats.queue_wait_ns,
+  };
+  for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); ++i)
+    counters[i]->store(0, std::memory_order_relaxed);
+  for (int i = 0; i < kLatencyBuckets; ++i)
+    g_stats.latency[i].store(0, std::memory_order_relaxed);
+}
+
+static bool ParseDigestAlgorithm(Local<Value> value, DIGEST_ALGORITHM* algorithm) {
+  *algorithm = DIGEST_SHA1;
+  if (value->IsUndefined())
+    return true;
+  return value->IsString() &&
+      DigestAlgorithmFromString(*String::Utf8Value(v8::Isolate::GetCurrent(), value),
+                                algorithm);
+}
+
+static Local<Value> DigestErrorToV8Value(int error_number) {
+  return ErrorToV8Value("Unable to digest file", error_number);
+}
+
+// Hashes a file on the threadpool.
+class DigestWorker : public Nan::AsyncWorker {
+ public:
+  DigestWorker(Nan::Callback* callback,
+               const std::string& path,
+               DIGEST_ALGORITHM algorithm)
+      : Nan::AsyncWorker(callback, "pathwatcher:digest"),
+        path_(path),
+        algorithm_(algorithm),
+        result_(0) {}
+
+  void Execute() {
+    result_ = FileDigest(path_, algorithm_, &digest_);
+  }
+
+  void HandleOKCallback() {
+    Nan::HandleScope scope;
+
+    if (result_ < 0) {
+      Local<Value> argv[] = { DigestErrorToV8Value(-result_) };
+      callback->Call(1, argv, async_resource);
+      return;
+    }
+
+    Local<Value> argv[] = { Nan::Null(), Nan::New(digest_).ToLocalChecked() };
+    callback->Call(2, argv, async_resource);
+  }
+
+ private:
+  std::string path_;
+  DIGEST_ALGORITHM algorithm_;
+  int result_;
+  std::string digest_;
+};
+
+NAN_METHOD(Digest) {
+  Nan::HandleScope scope;
+
+  DIGEST_ALGORITHM algorithm;
+  if (!info[0]->IsString())
+    return Nan::ThrowTypeError("String required");
+  if (!ParseDigestAlgorithm(info[1], &algorithm))
+    return Nan::ThrowTypeError("Unknown digest algorithm");
+  if (!info[2]->IsFunction())
+    return Nan::ThrowTypeError("Function required");
+
+  std::string path = *String::Utf8Value(v8::Isolate::GetCurrent(), info[0]);
+  Nan::Callback* callback = new Nan::Callback(info[2].As<Function>());
+  Nan::AsyncQueueWorker(new DigestWorker(callback, path, algorithm));
+}
+
+NAN_METHOD(DigestSync) {
+  Nan::HandleScope scope;
+
+  DIGEST_ALGORITHM algorithm;
+  if (!info[0]->IsString())
+    return Nan::ThrowTypeError("String required");
+  if (!ParseDigestAlgorithm(info[1], &algorithm))
+    return Nan::ThrowTypeError("Unknown digest algorithm");
+
+  std::string digest;
+  int r = FileDigest(*String::Utf8Value(v8::Isolate::GetCurrent(), info[0]),
+                     algorithm, &digest);
+  if (r < 0)
+    return Nan::ThrowError(DigestErrorToV8Value(-r));
+
+  info.GetReturnValue().Set(Nan::New(digest).ToLocalChecked());
+}
+
+static Local<Value> BlocksErrorToV8Value(int error_number) {
+  return ErrorToV8Value("Unable to hash file blocks", error_number);
+}
+
+static Local<Object> BlockRangesToV8Value(const BlockHashes& blocks,
+                                          const std::vector<ByteRange>& ranges) {
+  Local<Object> obj = Nan::New<Object>();
+  Nan::Set(obj, Nan::New("size").ToLocalChecked(),
+           Nan::New<Number>(static_cast<double>(blocks.size)));
+  Local<Array> flat = Nan::New<Array>(ranges.size() * 2);
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    Nan::Set(flat, i * 2, Nan::New<Number>(static_cast<double>(ranges[i].start)));
+    Nan::Set(flat, i * 2 + 1, Nan::New<Number>(static_cast<double>(ranges[i].end)));
+  }
+  Nan::Set(obj, Nan::New("ranges").ToLocalChecked(), flat);
+  return obj;
+}
+
+// Block hashes cross to JS as a Buffer, which only the next diff reads.
+static Local<Object> BlockDiffToV8Value(const BlockHashes& blocks,
+                                        const std::vector<ByteRange>& ranges) {
+  Local<Object> obj = BlockRangesToV8Value(blocks, ranges);
+  Nan::Set(obj, Nan::New("hashes").ToLocalChecked(),
+           Nan::CopyBuffer(reinterpret_cast<const char*>(blocks.hashes.data()),
+                           blocks.hashes.size() * sizeof(uint64_t)).ToLocalChecked());
+  return obj;
+}
+
+// Parses the arguments of DiffBlocks and DiffBlocksSync, throwing and
+// returning false if they are invalid. Without previous hashes the whole file
+// is reported as changed.
+static bool ParseBlockDiffArguments(const Nan::FunctionCallbackInfo<Value>& info,
+                                    std::string* path,
+                                    size_t* block_size,
+                                    bool* has_previous,
+                                    BlockHashes* previous) {
+  if (!info[0]->IsString()) {
+    Nan::ThrowTypeError("String required");
+    return false;
+  }
+  if (!info[1]->IsUint32() || Nan::To<uint32_t>(info[1]).FromJust() == 0) {
+    Nan::ThrowTypeError("Number required");
+    return false;
+  }
+  *has_previous = node::Buffer::HasInstance(info[2]);
+  if (!*has_previous && !info[2]->IsNull()) {
+    Nan::ThrowTypeError("Buffer required");
+    return false;
+  }
+
+  *path = *String::Utf8Value(v8::Isolate::GetCurrent(), info[0]);
+  *block_size = Nan::To<uint32_t>(info[1]).FromJust();
+  if (*has_previous) {
+    // Copied, the Buffer may change before the threadpool gets to it.
+    const char* data = node::Buffer::Data(info[2]);
+    size_t count = node::Buffer::Length(info[2]) / sizeof(uint64_t);
+    previous->hashes.resize(count);
+    memcpy(previous->hashes.data(), data, count * sizeof(uint64_t));
+  }
+  return true;
+}
+
+static int DiffFileBlocks(const std::string& path,
+                          size_t block_size,
+                          bool has_previous,
+                          const BlockHashes& previous,
+                          BlockHashes* current,
+                          std::vector<ByteRange>* ranges) {
+  int r = HashFileBlocks(path, block_size, current);
+  if (r < 0)
+    return r;
+
+  if (has_previous) {
+    DiffBlockHashes(previous, *current, block_size, ranges);
+  } else if (current->size > 0) {
+    ByteRange whole = { 0, current->size };
+    ranges->push_back(whole);
+  }
+  return 0;
+}
+
+// Hashes the blocks of a file on the threadpool and compares them with the
+// hashes of its previous version.
+class DiffBlocksWorker : public Nan::AsyncWorker {
+ public:
+  DiffBlocksWorker(Nan::Callback* callback,
+                   const std::string& path,
+                   size_t block_size,
+                   bool has_previous,
+                   const BlockHashes& previous)
+      : Nan::AsyncWorker(callback, "pathwatcher:diffBlocks"),
+        path_(path),
+        block_size_(block_size),
+        has_previous_(has_previous),
+        previous_(previous),
+        result_(0) {}
+
+  void Execute() {
+    result_ = DiffFileBlocks(path_, block_size_, has_previous_, previous_,
+                             &current_, &ranges_);
+  }
+
+  void HandleOKCallback() {
+    Nan::HandleScope scope;
+
+    if (result_ < 0) {
+      Local<Value> argv[] = { BlocksErrorToV8Value(-result_) };
+      callback->Call(1, argv, async_resource);
+      return;
+    }
+
+    Local<Value> argv[] = { Nan::Null(), BlockDiffToV8Value(current_, ranges_) };
+    callback->Call(2, argv, async_resource);
+  }
+
+ private:
+  std::string path_;
+  size_t block_size_;
+  bool has_previous_;
+  BlockHashes previous_;
+  int result_;
+  BlockHashes current_;
+  std::vector<ByteRange> ranges_;
+};
+
+NAN_METHOD(DiffBlocks) {
+  Nan::HandleScope scope;
+
+  std::string path;
+  size_t block_size;
+  bool has_previous;
+  BlockHashes previous;
+  if (!ParseBlockDiffArguments(info, &path, &block_size, &has_previous, &previous))
+    return;
+  if (!info[3]->IsFunction())
+    return Nan::ThrowTypeError("Function required");
+
+  Nan::Callback* callback = new Nan::Callback(info[3].As<Function>());
+  Nan::AsyncQueueWorker(
+      new DiffBlocksWorker(callback, path, block_size, has_previous, previous));
+}
+
+NAN_METHOD(DiffBlocksSync) {
+  Nan::HandleScope scope;
+
+  std::string path;
+  size_t block_size;
+  bool has_previous;
+  BlockHashes previous;
+  if (!ParseBlockDiffArguments(info, &path, &block_size, &has_previous, &previous))
+    return;
+
+  BlockHashes current;
+  std::vector<ByteRange> ranges;
+  int r = DiffFileBlocks(path, block_size, has_previous, previous, &current, &ranges);
+  if (r < 0)
+    return Nan::ThrowError(BlocksErrorToV8Value(-r));
+
+  info.GetReturnValue().Set(BlockDiffToV8Value(current, ranges));
+}
+
+// Diffs the watched file of a watch with the blocks option against the hashes
+// kept for it since the previous diff, on the threadpool. Diffs of a handle
+// have to run one after the other, and handles of other environments fail
+// as unknown ones.
+class DiffWatchBlocksWorker : public Nan::AsyncWorker {
+ public:
+  DiffWatchBlocksWorker(Nan::Callback* callback,
+                        WatcherHandle handle,
+                        bool reset,
+                        bool owned)
+      : Nan::AsyncWorker(callback, "pathwatcher:diffWatchBlocks"),
+        handle_(handle),
+        reset_(reset),
+        owned_(owned),
+        result_(0) {}
+
+  void Execute() {
+    if (!owned_) {
+      result_ = UV_EBADF;
+      return;
+    }
+
+    std::string path;
+    size_t block_size;
+    bool has_previous;
+    BlockHashes previous;
+    {
+      ScopedLocker locker(g_watched_mutex);
+      std::unordered_map<WatcherHandle, WatchedPath>::iterator iter =
+          g_watched->find(handle_);
+      if (iter == g_watched->end() || iter->second.block_size == 0) {
+        result_ = UV_EBADF;
+        return;
+      }
+
+      WatchedPath& entry = iter->second;
+      path = entry.path;
+      block_size = entry.block_size;
+      has_previous = entry.has_blocks && !reset_;
+      if (has_previous)
+        previous.hashes.swap(entry.blocks.hashes);
+      entry.has_blocks = false;
+    }
+
+    BlockHashes current;
+    result_ = DiffFileBlocks(path, block_size, has_previous, previous,
+                             &current, &ranges_);
+    size_ = current.size;
+    if (result_ < 0)
+      return;
+
+    ScopedLocker locker(g_watched_mutex);
+    std::unordered_map<WatcherHandle, WatchedPath>::iterator iter =
+        g_watched->find(handle_);
+    if (iter != g_watched->end()) {
+      iter->second.blocks.size = current.size;
+      iter->second.blocks.hashes.swap(current.hashes);
+      iter->second.has_blocks = true;
+    }
+  }
+
+  void HandleOKCallback() {
+    Nan::HandleScope scope;
+
+    if (result_ < 0) {
+      Local<Value> argv[] = { BlocksErrorToV8Value(-result_) };
+      callback->Call(1, argv, async_resource);
+      return;
+    }
+
+    BlockHashes blocks;
+    blocks.size = size_;
+    Local<Value> argv[] = { Nan::Null(), BlockRangesToV8Value(blocks, ranges_) };
+    callback->Call(2, argv, async_resource);
+  }
+
+ private:
+  WatcherHandle handle_;
+  bool reset_;
+  bool owned_;
+  int result_;
+  uint64_t size_;
+  std::vector<ByteRange> ranges_;
+};
+
+NAN_METHOD(DiffWatchBlocks) {
+  Nan::HandleScope scope;
+
+  if (!IsV8ValueWatcherHandle(info[0]))
+    return Nan::ThrowTypeError("Local type required");
+  if (!info[2]->IsFunction())
+    return Nan::ThrowTypeError("Function required");
+
+  WatcherHandle handle = V8ValueToWatcherHandle(info[0]);
+  bool owned = GetEnvironment(info)->registry.Has(handle);
+  Nan::Callback* callback = new Nan::Callback(info[2].As<Function>());
+  Nan::AsyncQueueWorker(new DiffWatchBlocksWorker(
+      callback, handle, Nan::To<bool>(info[1]).FromJust(), owned));
+}
+
+// Text of at least this size is decoded off the main thread and handed to V8
+// as an external string, smaller text is cheaper to copy into the heap.
+static const size_t kExternalTextSize = 64 * 1024;
+
+// Owns the buffers of external strings, V8 deletes them with the string.
+class ExternalOneByteText : public Nan::ExternalOneByteStringResource {
+ public:
+  explicit ExternalOneByteText(std::string* bytes) { data_.swap(*bytes); }
+  const char* data() const { return data_.data(); }
+  size_t length() const { return data_.size(); }
+
+ private:
+  std::string data_;
+};
+
+class ExternalTwoByteText : public v8::String::ExternalStringResource {
+ public:
+  explicit ExternalTwoByteText(std::vector<uint16_t>* utf16) { data_.swap(*utf16); }
+  const uint16_t* data() const { return data_.data(); }
+  size_t length() const { return data_.size(); }
+
+ private:
+  std::vector<uint16_t> data_;
+};
+
+static Local<String> FileTextToV8Value(FileText* text) {
+  switch (text->form) {
+    case FileText::FORM_ONE_BYTE:
+      return Nan::New<String>(new ExternalOneByteText(&text->bytes)).ToLocalChecked();
+    case FileText::FORM_TWO_BYTE:
+      return Nan::New<String>(new ExternalTwoByteText(&text->utf16)).ToLocalChecked();
+    default:
+      return Nan::New<String>(text->bytes).ToLocalChecked();
+  }
+}
+
+static Local<Value> ReadFileErrorToV8Value(int error_number) {
+  return ErrorToV8Value("Unable to read file", error_number);
+}
+
+static Local<Value> FileTextDigestToV8Value(const FileText& text) {
+  if (text.digest.empty())
+    return Nan::Null();
+  return Nan::New<String>(text.digest).ToLocalChecked();
+}
+
+static int ReadFileString(const std::string& path, bool digest, FileText* text) {
+  // Bytes of UTF-8 decode to at most as many UTF-16 units, so any file that
+  // fits can be made a string.
+  return ReadFileText(path, String::kMaxLength, kExternalTextSize, digest, text);
+}
+
+// Reads and decodes a UTF-8 file on the threadpool, hashing it there too when
+// asked.
+class ReadFileWorker : public Nan::AsyncWorker {
+ public:
+  ReadFileWorker(Nan::Callback* callback, const std::string& path, bool digest)
+      : Nan::AsyncWorker(callback, "pathwatcher:readFile"),
+        path_(path),
+        digest_(digest),
+        result_(0) {}
+
+  void Execute() {
+    result_ = ReadFileString(path_, digest_, &text_);
+  }
+
+  void HandleOKCallback() {
+    Nan::HandleScope scope;
+
+    if (result_ < 0) {
+      Local<Value> argv[] = { ReadFileErrorToV8Value(-result_) };
+      callback->Call(1, argv, async_resource);
+      return;
+    }
+
+    Local<Value> digest = FileTextDigestToV8Value(text_);
+    Local<Value> argv[] = { Nan::Null(), FileTextToV8Value(&text_), digest };
+    callback->Call(3, argv, async_resource);
+  }
+
+ private:
+  std::string path_;
+  bool digest_;
+  int result_;
+  FileText text_;
+};
+
+NAN_METHOD(ReadFile) {
+  Nan::HandleScope scope;
+
+  if (!info[0]->IsString())
+    return Nan::ThrowTypeError("String required");
+  if (!info[2]->IsFunction())
+    return Nan::ThrowTypeError("Function required");
+
+  std::string path = *String::Utf8Value(v8::Isolate::GetCurrent(), info[0]);
+  bool digest = Nan::To<bool>(info[1]).FromJust();
+  Nan::Callback* callback = new Nan::Callback(info[2].As<Function>());
+  Nan::AsyncQueueWorker(new ReadFileWorker(callback, path, digest));
+}
+
+NAN_METHOD(ReadFileSync) {
+  Nan::HandleScope scope;
+
+  if (!info[0]->IsString())
+    return Nan::ThrowTypeError("String required");
+
+  FileText text;
+  bool digest = Nan::To<bool>(info[1]).FromJust();
+  int r = ReadFileString(*String::Utf8Value(v8::Isolate::GetCurrent(), info[0]),
+                         digest, &text);
+  if (r < 0)
+    return Nan::ThrowError(ReadFileErrorToV8Value(-r));
+
+  if (!digest)
+    return info.GetReturnValue().Set(FileTextToV8Value(&text));
+
+  // Both come back at once, as with the callback of readFile.
+  Local<Array> result = Nan::New<Array>(2);
+  Nan::Set(result, 0, FileTextToV8Value(&text));
+  Nan::Set(result, 1, FileTextDigestToV8Value(text));
+  info.GetReturnValue().Set(result);
+}
+
+// Entries cross to JS as one flat array of names each followed by its type.
+static Local<Array> DirectoryEntriesToV8Value(const std::vector<DirectoryEntry>& entries) {
+  Local<Array> result = Nan::New<Array>(entries.size() * 2);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    Nan::Set(result, i * 2, Nan::New(entries[i].name).ToLocalChecked());
+    Nan::Set(result, i * 2 + 1, Nan::New<Integer>(entries[i].type));
+  }
+  return result;
+}
+
+static Local<Value> ReaddirErrorToV8Value(int error_number) {
+  return ErrorToV8Value("Unable to read directory", error_number);
+}
+
+// Lists a directory on the threadpool.
+class ReaddirWorker : public Nan::AsyncWorker {
+ public:
+  ReaddirWorker(Nan::Callback* callback, const std::string& path)
+      : Nan::AsyncWorker(callback, "pathwatcher:readdir"),
+        path_(path),
+        result_(0) {}
+
+  void Execute() {
+    result_ = ListDirectory(path_, &entries_);
+  }
+
+  void HandleOKCallback() {
+    Nan::HandleScope scope;
+
+    if (result_ < 0) {
+      Local<Value> argv[] = { ReaddirErrorToV8Value(-result_) };
+      callback->Call(1, argv, async_resource);
+      return;
+    }
+
+    Local<Value> argv[] = { Nan::Null(), DirectoryEntriesToV8Value(entries_) };
+    callback->Call(2, argv, async_resource);
+  }
+
+ private:
+  std::string path_;
+  int result_;
+  std::vector<DirectoryEntry> entries_;
+};
+
+NAN_METHOD(ReaddirWithTypes) {
+  Nan::HandleScope scope;
+
+  if (!info[0]->IsString())
+    return Nan::ThrowTypeError("String required");
+  if (!info[1]->IsFunction())
+    return Nan::ThrowTypeError("Function required");
+
+  std::string path = *String::Utf8Value(v8::Isolate::GetCurrent(), info[0]);
+  Nan::Callback* callback = new Nan::Callback(info[1].As<Function>());
+  Nan::AsyncQueueWorker(new ReaddirWorker(callback, path));
+}
+
+NAN_METHOD(ReaddirWithTypesSync) {
+  Nan::HandleScope scope;
+
+  if (!info[0]->IsString())
+    return Nan::ThrowTypeError("String required");
+
+  std::vector<DirectoryEntry> entries;
+  int r = ListDirectory(*String::Utf8Value(v8::Isolate::GetCurrent(), info[0]), &entries);
+  if (r < 0)
+    return Nan::ThrowError(ReaddirErrorToV8Value(-r));
+
+  info.GetReturnValue().Set(DirectoryEntriesToV8Value(entries));
+}
+
+static Local<Value> SnapshotErrorToV8Value(int error_number) {
+  return ErrorToV8Value("Unable to snapshot tree", error_number);
+}
+
+// Scans a tree on the threadpool, either to write its first snapshot or to
+// compare it with the one written before.
+class TreeSnapshotWorker : public Nan::AsyncWorker {
+ public:
+  TreeSnapshotWorker(Nan::Callback* callback,
+                     const std::string& root,
+                     const std::string& file,
+                     bool diff,
+                     bool update)
+      : Nan::AsyncWorker(callback, "pathwatcher:snapshot"),
+        root_(root),
+        file_(file),
+        diff_(diff),
+        update_(update),
+        result_(0) {}
+
+  void Execute() {
+    TreeSnapshot previous;
+    if (diff_ && (result_ = previous.Load(file_)) < 0)
+      return;
+
+    TreeSnapshot current;
+    result_ = current.Scan(root_, diff_ ? &previous : NULL, &changes_);
+    if (result_ >= 0 && update_)
+      result_ = current.Save(file_);
+  }
+
+  void HandleOKCallback() {
+    Nan::HandleScope scope;
+
+    if (result_ < 0) {
+      Local<Value> argv[] = { SnapshotErrorToV8Value(-result_) };
+      callback->Call(1, argv, async_resource);
+      return;
+    }
+
+    // Changes cross to JS as one flat array of event types each followed by
+    // the path.
+    Local<Array> changes = Nan::New<Array>(changes_.size() * 2);
+    for (size_t i = 0; i < changes_.size(); ++i) {
+      Nan::Set(changes, i * 2, EventTypeToV8Value(changes_[i].type));
+      Nan::Set(changes, i * 2 + 1, Nan::New(changes_[i].path).ToLocalChecked());
+    }
+    Local<Value> argv[] = { Nan::Null(), changes };
+    callback->Call(2, argv, async_resource);
+  }
+
+ private:
+  std::string root_;
+  std::string file_;
+  bool diff_;
+  bool update_;
+  int result_;
+  std::vector<TreeChange> changes_;
+};
+
+NAN_METHOD(WriteTreeSnapshot) {
+  Nan::HandleScope scope;
+
+  if (!info[0]->IsString() || !info[1]->IsString())
+    return Nan::ThrowTypeError("String required");
+  if (!info[2]->IsFunction())
+    return Nan::ThrowTypeError("Function required");
+
+  v8::Isolate* isolate = v8::Isolate::GetCurrent();
+  Nan::Callback* callback = new Nan::Callback(info[2].As<Function>());
+  Nan::AsyncQueueWorker(new TreeSnapshotWorker(callback,
+                                               *String::Utf8Value(isolate, info[0]),
+                                               *String::Utf8Value(isolate, info[1]),
+                                               false,
+                                               true));
+}
+
+NAN_METHOD(DiffTreeSnapshot) {
+  Nan::HandleScope scope;
+
+  if (!info[0]->IsString() || !info[1]->IsString())
+    return Nan::ThrowTypeError("String required");
+  if (!info[3]->IsFunction())
+    return Nan::ThrowTypeError("Function required");
+
+  v8::Isolate* isolate = v8::Isolate::GetCurrent();
+  bool update = Nan::To<bool>(info[2]).FromJust();
+  Nan::Callback* callback = new Nan::Callback(info[3].As<Function>());
+  Nan::AsyncQueueWorker(new TreeSnapshotWorker(callback,
+                                               *String::Utf8Value(isolate, info[0]),
+                                               *String::Utf8Value(isolate, info[1]),
+                                               true,
+                                               update));
 }
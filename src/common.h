@@ -1,9 +1,12 @@
 #ifndef SRC_COMMON_H_
 #define SRC_COMMON_H_
 
+#include <memory>
+#include <string>
 #include <vector>
 
 #include "nan.h"
+#include "path_filter.h"
 using namespace v8;
 
 #ifdef _WIN32
@@ -14,6 +17,10 @@ typedef HANDLE WatcherHandle;
 Local<Value> WatcherHandleToV8Value(WatcherHandle handle);
 WatcherHandle V8ValueToWatcherHandle(Local<Value> value);
 bool IsV8ValueWatcherHandle(Local<Value> value);
+
+// Per-environment state of the conversions above.
+void PlatformInitEnvironment();
+void PlatformCleanupEnvironment();
 #else
 // Correspoding definetions on OS X and Linux.
 typedef int32_t WatcherHandle;
@@ -22,13 +29,66 @@ typedef int32_t WatcherHandle;
 #define IsV8ValueWatcherHandle(v) v->IsInt32()
 #endif
 
+struct WatchOptions {
+  WatchOptions()
+      : recursive(false), coalesce_ms(-1), resurrect(false), stat(false),
+        poll(false), tail(false), block_size(0) {}
+
+  // Also watch every directory below the path.
+  bool recursive;
+  // Window for merging repeated change events, negative for the default.
+  int coalesce_ms;
+  // Keep the watch of a deleted file and report when it is created again.
+  bool resurrect;
+  // Attach the metadata of the changed path to events, and drop changes that
+  // left its content untouched.
+  bool stat;
+  // Find changes by polling instead of asking the kernel, for file systems
+  // whose changes it does not see, like NFS. Only the inotify backend polls.
+  bool poll;
+  // Read what was appended to changed files and deliver it with the event.
+  bool tail;
+  // Keep the block hashes of the watched file for DiffWatchBlocks, 0 for
+  // none.
+  uint32_t block_size;
+  // Events to deliver, NULL for all of them.
+  std::shared_ptr<const PathFilter> filter;
+};
+
 void PlatformInit();
 void PlatformThread();
-WatcherHandle PlatformWatch(const char* path);
+WatcherHandle PlatformWatch(const char* path, const WatchOptions& options);
 void PlatformUnwatch(WatcherHandle handle);
 bool PlatformIsHandleValid(WatcherHandle handle);
 int PlatformInvalidHandleToErrorNumber(WatcherHandle handle);
 
+// Limits of the kernel notification queue, -1 when unknown.
+struct WatchLimits {
+  int64_t max_queued_events;
+  int64_t max_user_watches;
+  int64_t max_user_instances;
+  // Watches and instances in use by this process.
+  int64_t watches;
+  int64_t instances;
+  // Bytes waiting to be read by the watcher thread.
+  int64_t queued_bytes;
+  // Kernel watches this process uses before polling the least recently active
+  // paths instead.
+  int64_t watch_budget;
+};
+
+// Returns false when the platform has no such limits.
+bool PlatformGetWatchLimits(WatchLimits* limits);
+// Sets the watch budget, a budget of 0 or less restores the default. Watches
+// already polled stay polled.
+void PlatformSetWatchBudget(int64_t budget);
+// Appends the watches that are polled instead of watched by the kernel.
+void PlatformGetPolledWatches(std::vector<WatcherHandle>* handles);
+// Makes the watcher thread handle an overflow of the kernel queue as if the
+// kernel had reported one, for the specs. Returns false when the platform has
+// no such report.
+bool PlatformSimulateOverflow();
+
 enum EVENT_TYPE {
   EVENT_NONE,
   EVENT_CHANGE,
@@ -38,19 +98,149 @@ enum EVENT_TYPE {
   EVENT_CHILD_RENAME,
   EVENT_CHILD_DELETE,
   EVENT_CHILD_CREATE,
+  // Events were lost, the watched path has to be read again.
+  EVENT_RESCAN,
+  // A deleted file watched with the resurrect option exists again.
+  EVENT_RESURRECT,
+};
+
+struct ScopedLocker {
+  explicit ScopedLocker(uv_mutex_t& mutex) : mutex_(&mutex), locked_(true) { uv_mutex_lock(mutex_); }
+  ~ScopedLocker() { Unlock(); }
+
+  void Unlock() {
+    if (locked_) {
+      locked_ = false;
+      uv_mutex_unlock(mutex_);
+    }
+  }
+
+  uv_mutex_t* mutex_;
+  bool locked_;
+};
+
+// A file is only known to be unchanged when its stat matches one taken this
+// long after its timestamps, since writes within the timestamp granularity of
+// the file system leave them as they were.
+const uint64_t kRacyTimestampNs = 2000000000ull;
+// Wall clock time in nanoseconds, as file timestamps are.
+uint64_t WallClockNs();
+
+// Metadata of the path of an event, taken by the watcher thread.
+struct EventStat {
+  bool valid;
+  uint64_t ino;
+  uint64_t size;
+  uint64_t mtime_ns;
+  uint32_t mode;
+};
+
+// What a change did to the end of a file watched with the tail option.
+enum TAIL_STATE {
+  TAIL_NONE,
+  // Bytes were appended, and are carried by the event.
+  TAIL_APPENDED,
+  // The file was replaced or truncated, or grew too much to carry, and has
+  // to be read again.
+  TAIL_RELOAD,
+};
+
+struct WatcherEvent {
+  EVENT_TYPE type;
+  WatcherHandle handle;
+  std::vector<char> new_path;
+  std::vector<char> old_path;
+  // Number of events merged into this one.
+  uint32_t count;
+  // Only valid for watches with the stat option.
+  EventStat stat;
+  // uv_hrtime() when the backend posted the event, 0 for synthesized ones.
+  uint64_t posted_at;
+  // Only set for watches with the tail option.
+  TAIL_STATE tail;
+  std::string appended;
+  // uv_hrtime() when the event was queued for the JS thread.
+  uint64_t queued_at;
 };
 
 void WaitForMainThread();
 void WakeupNewThread();
-void PostEventAndWait(EVENT_TYPE type,
-                      WatcherHandle handle,
-                      const std::vector<char>& new_path,
-                      const std::vector<char>& old_path = std::vector<char>());
+// Name of the backend in getStats().
+const char* PlatformName();
+// Counts what a backend read from the kernel, for getStats().
+void CountKernelEvents(size_t events, size_t bytes);
+// Queues an event for the main thread, never blocks the calling thread.
+void PostEvent(EVENT_TYPE type,
+               WatcherHandle handle,
+               const std::vector<char>& new_path,
+               const std::vector<char>& old_path = std::vector<char>());
+// Same for a change the backend knows only touched metadata (permissions,
+// timestamps, extended attributes), so that watches with the stat option can
+// drop it unless the size or inode changed.
+void PostAttributeEvent(EVENT_TYPE type,
+                        WatcherHandle handle,
+                        const std::vector<char>& path);
+
+// Holds back the events posted on the calling thread while it is alive, and
+// stats the paths and reads the appended bytes of watches with the stat and
+// tail options when it goes away. Backends that post with their own lock held
+// declare it before the ScopedLocker, so that the files are accessed once the
+// lock is released.
+class ScopedEventBatch {
+ public:
+  ScopedEventBatch();
+  ~ScopedEventBatch();
+
+  // Adds |event| to the batch of the calling thread, returns false when there
+  // is none.
+  static bool Defer(WatcherEvent* event, bool attributes_only);
+
+ private:
+  struct DeferredEvent {
+    WatcherEvent event;
+    bool attributes_only;
+  };
+
+  std::vector<DeferredEvent> events_;
+  // Batches declared within another one leave their events to it.
+  bool outermost_;
+};
+// Delivers coalesced events whose window has closed, watcher threads should
+// call it whenever they wake up and wait no longer than PendingEventsTimeout()
+// milliseconds (-1 meaning forever).
+void FlushPendingEvents();
+int PendingEventsTimeout();
 
-void CommonInit();
+// Sets up the state of the calling environment, and the watcher thread the
+// first time. Returns the data to bind the methods below to.
+Local<Value> CommonInit();
 
 NAN_METHOD(SetCallback);
+NAN_METHOD(SetBatchCallback);
+NAN_METHOD(SetCoalesceWindow);
+NAN_METHOD(EnableJournal);
+NAN_METHOD(ChangesSince);
 NAN_METHOD(Watch);
 NAN_METHOD(Unwatch);
+NAN_METHOD(WatchMany);
+NAN_METHOD(WatchAsync);
+NAN_METHOD(UnwatchMany);
+NAN_METHOD(GetWatchLimits);
+NAN_METHOD(SetWatchBudget);
+NAN_METHOD(GetPolledWatches);
+NAN_METHOD(SimulateOverflow);
+NAN_METHOD(GetStats);
+NAN_METHOD(ResetStats);
+NAN_METHOD(Digest);
+NAN_METHOD(DigestSync);
+NAN_METHOD(ReadFile);
+NAN_METHOD(ReadFileSync);
+NAN_METHOD(DiffBlocks);
+NAN_METHOD(DiffBlocksSync);
+NAN_METHOD(DiffWatchBlocks);
+NAN_METHOD(ReaddirWithTypes);
+NAN_METHOD(ReaddirWithTypesSync);
+NAN_METHOD(WriteTreeSnapshot);
+NAN_METHOD(DiffTreeSnapshot);
 
 #endif  // SRC_COMMON_H_
@@ -0,0 +1,429 @@
+#include "digest.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <unordered_map>
+#include <vector>
+
+#include <uv.h>
+
+#include "common.h"
+
+// Files are read in chunks of this size.
+static const size_t kReadChunkSize = 256 * 1024;
+// Bound of the cache, an arbitrary entry is evicted when it is full.
+static const size_t kMaxCachedDigests = 8192;
+
+static const char kHexDigits[] = "0123456789abcdef";
+
+static std::string ToHex(const uint8_t* bytes, size_t length) {
+  std::string hex(length * 2, '0');
+  for (size_t i = 0; i < length; ++i) {
+    hex[i * 2] = kHexDigits[bytes[i] >> 4];
+    hex[i * 2 + 1] = kHexDigits[bytes[i] & 0xf];
+  }
+  return hex;
+}
+
+static uint32_t RotateLeft32(uint32_t value, int bits) {
+  return (value << bits) | (value >> (32 - bits));
+}
+
+static uint64_t RotateLeft64(uint64_t value, int bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+static uint32_t ReadBigEndian32(const uint8_t* p) {
+  return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+         (static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+}
+
+static uint32_t ReadLittleEndian32(const uint8_t* p) {
+  return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+         (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static uint64_t ReadLittleEndian64(const uint8_t* p) {
+  return static_cast<uint64_t>(ReadLittleEndian32(p)) |
+         (static_cast<uint64_t>(ReadLittleEndian32(p + 4)) << 32);
+}
+
+// Streaming digests share this interface so that the file is read once
+// whatever the algorithm.
+class Hasher {
+ public:
+  virtual ~Hasher() {}
+  virtual void Update(const uint8_t* data, size_t length) = 0;
+  virtual std::string HexDigest() = 0;
+};
+
+// SHA-1 as specified by FIPS 180-4, matching crypto.createHash('sha1').
+class Sha1Hasher : public Hasher {
+ public:
+  Sha1Hasher() : length_(0), buffered_(0) {
+    state_[0] = 0x67452301;
+    state_[1] = 0xefcdab89;
+    state_[2] = 0x98badcfe;
+    state_[3] = 0x10325476;
+    state_[4] = 0xc3d2e1f0;
+  }
+
+  void Update(const uint8_t* data, size_t length) {
+    length_ += length;
+    if (buffered_ > 0) {
+      size_t take = std::min(length, sizeof(buffer_) - buffered_);
+      memcpy(buffer_ + buffered_, data, take);
+      buffered_ += take;
+      data += take;
+      length -= take;
+      if (buffered_ < sizeof(buffer_))
+        return;
+      Transform(buffer_);
+      buffered_ = 0;
+    }
+    for (; length >= sizeof(buffer_); data += sizeof(buffer_), length -= sizeof(buffer_))
+      Transform(data);
+    memcpy(buffer_, data, length);
+    buffered_ = length;
+  }
+
+  std::string HexDigest() {
+    uint64_t bit_length = length_ * 8;
+    uint8_t padding[72] = { 0x80 };
+    size_t padding_length = (buffered_ < 56 ? 56 : 120) - buffered_;
+    for (int i = 0; i < 8; ++i)
+      padding[padding_length + i] = static_cast<uint8_t>(bit_length >> (56 - i * 8));
+    Update(padding, padding_length + 8);
+
+    uint8_t digest[20];
+    for (int i = 0; i < 5; ++i) {
+      digest[i * 4] = static_cast<uint8_t>(state_[i] >> 24);
+      digest[i * 4 + 1] = static_cast<uint8_t>(state_[i] >> 16);
+      digest[i * 4 + 2] = static_cast<uint8_t>(state_[i] >> 8);
+      digest[i * 4 + 3] = static_cast<uint8_t>(state_[i]);
+    }
+    return ToHex(digest, sizeof(digest));
+  }
+
+ private:
+  void Transform(const uint8_t* block) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; ++i)
+      w[i] = ReadBigEndian32(block + i * 4);
+    for (int i = 16; i < 80; ++i)
+      w[i] = RotateLeft32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3], e = state_[4];
+    for (int i = 0; i < 80; ++i) {
+      uint32_t f, k;
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5a827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ed9eba1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8f1bbcdc;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xca62c1d6;
+      }
+      uint32_t temp = RotateLeft32(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = RotateLeft32(b, 30);
+      b = a;
+      a = temp;
+    }
+
+    state_[0] += a;
+    state_[1] += b;
+    state_[2] += c;
+    state_[3] += d;
+    state_[4] += e;
+  }
+
+  uint32_t state_[5];
+  uint64_t length_;
+  uint8_t buffer_[64];
+  size_t buffered_;
+};
+
+static const uint64_t kPrime64_1 = 0x9e3779b185ebca87ULL;
+static const uint64_t kPrime64_2 = 0xc2b2ae3d27d4eb4fULL;
+static const uint64_t kPrime64_3 = 0x165667b19e3779f9ULL;
+static const uint64_t kPrime64_4 = 0x85ebca77c2b2ae63ULL;
+static const uint64_t kPrime64_5 = 0x27d4eb2f165667c5ULL;
+
+// xxHash64 with a zero seed, matching the reference implementation.
+class Xxh64Hasher : public Hasher {
+ public:
+  Xxh64Hasher() : length_(0), buffered_(0) {
+    lanes_[0] = kPrime64_1 + kPrime64_2;
+    lanes_[1] = kPrime64_2;
+    lanes_[2] = 0;
+    lanes_[3] = 0 - kPrime64_1;
+  }
+
+  void Update(const uint8_t* data, size_t length) {
+    length_ += length;
+    if (buffered_ > 0) {
+      size_t take = std::min(length, sizeof(buffer_) - buffered_);
+      memcpy(buffer_ + buffered_, data, take);
+      buffered_ += take;
+      data += take;
+      length -= take;
+      if (buffered_ < sizeof(buffer_))
+        return;
+      Consume(buffer_);
+      buffered_ = 0;
+    }
+    for (; length >= sizeof(buffer_); data += sizeof(buffer_), length -= sizeof(buffer_))
+      Consume(data);
+    memcpy(buffer_, data, length);
+    buffered_ = length;
+  }
+
+  std::string HexDigest() {
+    uint64_t hash = Digest();
+    uint8_t digest[8];
+    for (int i = 0; i < 8; ++i)
+      digest[i] = static_cast<uint8_t>(hash >> (56 - i * 8));
+    return ToHex(digest, sizeof(digest));
+  }
+
+  uint64_t Digest() const {
+    uint64_t hash;
+    if (length_ >= sizeof(buffer_)) {
+      hash = RotateLeft64(lanes_[0], 1) + RotateLeft64(lanes_[1], 7) +
+             RotateLeft64(lanes_[2], 12) + RotateLeft64(lanes_[3], 18);
+      for (int i = 0; i < 4; ++i)
+        hash = (hash ^ Round(0, lanes_[i])) * kPrime64_1 + kPrime64_4;
+    } else {
+      hash = kPrime64_5;
+    }
+    hash += length_;
+
+    const uint8_t* p = buffer_;
+    const uint8_t* end = buffer_ + buffered_;
+    for (; p + 8 <= end; p += 8)
+      hash = RotateLeft64(hash ^ Round(0, ReadLittleEndian64(p)), 27) * kPrime64_1 + kPrime64_4;
+    if (p + 4 <= end) {
+      hash = RotateLeft64(hash ^ (ReadLittleEndian32(p) * kPrime64_1), 23) * kPrime64_2 + kPrime64_3;
+      p += 4;
+    }
+    for (; p < end; ++p)
+      hash = RotateLeft64(hash ^ (*p * kPrime64_5), 11) * kPrime64_1;
+
+    hash ^= hash >> 33;
+    hash *= kPrime64_2;
+    hash ^= hash >> 29;
+    hash *= kPrime64_3;
+    hash ^= hash >> 32;
+    return hash;
+  }
+
+ private:
+  static uint64_t Round(uint64_t lane, uint64_t input) {
+    return RotateLeft64(lane + input * kPrime64_2, 31) * kPrime64_1;
+  }
+
+  void Consume(const uint8_t* stripe) {
+    for (int i = 0; i < 4; ++i)
+      lanes_[i] = Round(lanes_[i], ReadLittleEndian64(stripe + i * 8));
+  }
+
+  uint64_t lanes_[4];
+  uint64_t length_;
+  uint8_t buffer_[32];
+  size_t buffered_;
+};
+
+// Identifies a version of a file, any write changes at least one of these.
+struct FileVersion {
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  uint64_t mtime_ns;
+  uint64_t ctime_ns;
+
+  bool operator==(const FileVersion& other) const {
+    return dev == other.dev && ino == other.ino && size == other.size &&
+           mtime_ns == other.mtime_ns && ctime_ns == other.ctime_ns;
+  }
+};
+
+static FileVersion ToFileVersion(const uv_stat_t& stat) {
+  FileVersion version = {
+    stat.st_dev,
+    stat.st_ino,
+    stat.st_size,
+    static_cast<uint64_t>(stat.st_mtim.tv_sec) * 1000000000 + stat.st_mtim.tv_nsec,
+    static_cast<uint64_t>(stat.st_ctim.tv_sec) * 1000000000 + stat.st_ctim.tv_nsec,
+  };
+  return version;
+}
+
+struct CachedDigest {
+  FileVersion version;
+  std::string digests[2];
+};
+
+static uv_once_t g_cache_once = UV_ONCE_INIT;
+static uv_mutex_t g_cache_mutex;
+// Used from the threadpool, the JS threads and the watcher thread, and never
+// destroyed.
+static std::unordered_map<std::string, CachedDigest>* g_cache;
+static std::atomic<size_t> g_cache_size(0);
+
+static void InitCache() {
+  uv_mutex_init(&g_cache_mutex);
+  g_cache = new std::unordered_map<std::string, CachedDigest>();
+}
+
+static bool LookupDigest(const std::string& path,
+                         const FileVersion& version,
+                         DIGEST_ALGORITHM algorithm,
+                         std::string* digest) {
+  ScopedLocker locker(g_cache_mutex);
+  std::unordered_map<std::string, CachedDigest>::const_iterator iter =
+      g_cache->find(path);
+  if (iter == g_cache->end() || !(iter->second.version == version))
+    return false;
+
+  *digest = iter->second.digests[algorithm];
+  return !digest->empty();
+}
+
+static void StoreDigest(const std::string& path,
+                        const FileVersion& version,
+                        DIGEST_ALGORITHM algorithm,
+                        const std::string& digest) {
+  ScopedLocker locker(g_cache_mutex);
+  std::unordered_map<std::string, CachedDigest>::iterator iter = g_cache->find(path);
+  if (iter == g_cache->end()) {
+    if (g_cache->size() >= kMaxCachedDigests)
+      g_cache->erase(g_cache->begin());
+    iter = g_cache->insert(std::make_pair(path, CachedDigest())).first;
+  }
+
+  CachedDigest& entry = iter->second;
+  if (!(entry.version == version)) {
+    entry.version = version;
+    entry.digests[DIGEST_SHA1].clear();
+    entry.digests[DIGEST_XXH64].clear();
+  }
+  entry.digests[algorithm] = digest;
+  g_cache_size.store(g_cache->size());
+}
+
+// Reads the whole file into |hasher|, and stores the version it had before
+// and after the read.
+static int HashFile(uv_file fd, Hasher* hasher, FileVersion* before, FileVersion* after) {
+  uv_fs_t req;
+  int r = uv_fs_fstat(NULL, &req, fd, NULL);
+  if (r < 0)
+    return r;
+  *before = ToFileVersion(req.statbuf);
+  uv_fs_req_cleanup(&req);
+
+  std::vector<char> chunk(kReadChunkSize);
+  uv_buf_t buf = uv_buf_init(chunk.data(), static_cast<unsigned int>(chunk.size()));
+  while ((r = uv_fs_read(NULL, &req, fd, &buf, 1, -1, NULL)) > 0) {
+    uv_fs_req_cleanup(&req);
+    hasher->Update(reinterpret_cast<const uint8_t*>(chunk.data()), r);
+  }
+  uv_fs_req_cleanup(&req);
+  if (r < 0)
+    return r;
+
+  r = uv_fs_fstat(NULL, &req, fd, NULL);
+  if (r < 0)
+    return r;
+  *after = ToFileVersion(req.statbuf);
+  uv_fs_req_cleanup(&req);
+  return 0;
+}
+
+uint64_t Xxh64(const void* data, size_t length) {
+  Xxh64Hasher hasher;
+  hasher.Update(static_cast<const uint8_t*>(data), length);
+  return hasher.Digest();
+}
+
+std::string Sha1Hex(const void* data, size_t length) {
+  Sha1Hasher hasher;
+  hasher.Update(static_cast<const uint8_t*>(data), length);
+  return hasher.HexDigest();
+}
+
+bool DigestAlgorithmFromString(const std::string& name,
+                               DIGEST_ALGORITHM* algorithm) {
+  if (name == "sha1") {
+    *algorithm = DIGEST_SHA1;
+  } else if (name == "xxh64") {
+    *algorithm = DIGEST_XXH64;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+int FileDigest(const std::string& path,
+               DIGEST_ALGORITHM algorithm,
+               std::string* digest) {
+  uv_once(&g_cache_once, InitCache);
+
+  uv_fs_t req;
+  int r = uv_fs_stat(NULL, &req, path.c_str(), NULL);
+  if (r < 0) {
+    uv_fs_req_cleanup(&req);
+    return r;
+  }
+  FileVersion version = ToFileVersion(req.statbuf);
+  uv_fs_req_cleanup(&req);
+  if (LookupDigest(path, version, algorithm, digest))
+    return 0;
+
+  uv_file fd = uv_fs_open(NULL, &req, path.c_str(), UV_FS_O_RDONLY, 0, NULL);
+  uv_fs_req_cleanup(&req);
+  if (fd < 0)
+    return fd;
+
+  Sha1Hasher sha1;
+  Xxh64Hasher xxh64;
+  Hasher* hasher = algorithm == DIGEST_SHA1 ? static_cast<Hasher*>(&sha1) : &xxh64;
+  uint64_t read_ns = WallClockNs();
+  FileVersion before, after;
+  r = HashFile(fd, hasher, &before, &after);
+  uv_fs_close(NULL, &req, fd, NULL);
+  uv_fs_req_cleanup(&req);
+  if (r < 0)
+    return r;
+
+  *digest = hasher->HexDigest();
+  // A file written while it was read has no consistent digest to remember,
+  // nor does one written so shortly before that another write could keep its
+  // timestamps.
+  if (before == after &&
+      std::max(after.mtime_ns, after.ctime_ns) + kRacyTimestampNs <= read_ns)
+    StoreDigest(path, after, algorithm, *digest);
+  return 0;
+}
+
+void InvalidateDigest(const std::string& path) {
+  if (!HasCachedDigests())
+    return;
+
+  ScopedLocker locker(g_cache_mutex);
+  g_cache->erase(path);
+  g_cache_size.store(g_cache->size());
+}
+
+bool HasCachedDigests() {
+  return g_cache_size.load() > 0;
+}
@@ -0,0 +1,36 @@
+#ifndef SRC_DIGEST_H_
+#define SRC_DIGEST_H_
+
+#include <stdint.h>
+
+#include <string>
+
+enum DIGEST_ALGORITHM {
+  DIGEST_SHA1,
+  // xxHash64, much faster but not cryptographic.
+  DIGEST_XXH64,
+};
+
+// Returns false if |name| is not a supported algorithm.
+bool DigestAlgorithmFromString(const std::string& name,
+                               DIGEST_ALGORITHM* algorithm);
+
+// Hashes the contents of |path| into a hex string. Digests are cached by
+// path and reused while the file's device, inode, size, mtime and ctime stay
+// the same. Returns 0 or a negative libuv error code. Safe to call from any
+// thread.
+int FileDigest(const std::string& path,
+               DIGEST_ALGORITHM algorithm,
+               std::string* digest);
+
+// xxHash64 of |data| with a zero seed.
+uint64_t Xxh64(const void* data, size_t length);
+// SHA-1 of |data| as a hex string.
+std::string Sha1Hex(const void* data, size_t length);
+
+// Forgets the cached digests of |path|, called for the paths of watch events.
+void InvalidateDigest(const std::string& path);
+// Lets callers skip computing paths to invalidate while nothing is cached.
+bool HasCachedDigests();
+
+#endif  // SRC_DIGEST_H_
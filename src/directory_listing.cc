@@ -0,0 +1,85 @@
+#include "directory_listing.h"
+
+#include <sys/stat.h>
+
+#include <uv.h>
+
+#ifdef _WIN32
+static const char kSeparator = '\\';
+#else
+static const char kSeparator = '/';
+#endif
+
+static int TypeFromMode(uint64_t mode) {
+  switch (mode & S_IFMT) {
+    case S_IFREG:
+      return ENTRY_FILE;
+    case S_IFDIR:
+      return ENTRY_DIRECTORY;
+    default:
+      return ENTRY_OTHER;
+  }
+}
+
+// Returns the type of what |path| points to, following symlinks.
+static int StatType(const std::string& path) {
+  uv_fs_t req;
+  int r = uv_fs_stat(NULL, &req, path.c_str(), NULL);
+  int type = r < 0 ? ENTRY_OTHER : TypeFromMode(req.statbuf.st_mode);
+  uv_fs_req_cleanup(&req);
+  return type;
+}
+
+// For file systems that don't report the type of directory entries.
+static int LstatType(const std::string& path) {
+  uv_fs_t req;
+  int r = uv_fs_lstat(NULL, &req, path.c_str(), NULL);
+  uint64_t mode = r < 0 ? 0 : req.statbuf.st_mode;
+  uv_fs_req_cleanup(&req);
+  if (r < 0)
+    return ENTRY_OTHER;
+  if ((mode & S_IFMT) == S_IFLNK)
+    return ENTRY_SYMLINK | StatType(path);
+  return TypeFromMode(mode);
+}
+
+int ListDirectory(const std::string& path, std::vector<DirectoryEntry>* entries) {
+  uv_fs_t req;
+  int r = uv_fs_scandir(NULL, &req, path.c_str(), 0, NULL);
+  if (r < 0) {
+    uv_fs_req_cleanup(&req);
+    return r;
+  }
+
+  entries->reserve(r);
+  std::string prefix = path;
+  if (prefix.empty() || prefix[prefix.size() - 1] != kSeparator)
+    prefix += kSeparator;
+
+  uv_dirent_t dirent;
+  while (uv_fs_scandir_next(&req, &dirent) != UV_EOF) {
+    DirectoryEntry entry;
+    entry.name = dirent.name;
+    switch (dirent.type) {
+      case UV_DIRENT_FILE:
+        entry.type = ENTRY_FILE;
+        break;
+      case UV_DIRENT_DIR:
+        entry.type = ENTRY_DIRECTORY;
+        break;
+      case UV_DIRENT_LINK:
+        entry.type = ENTRY_SYMLINK | StatType(prefix + entry.name);
+        break;
+      case UV_DIRENT_UNKNOWN:
+        entry.type = LstatType(prefix + entry.name);
+        break;
+      default:
+        entry.type = ENTRY_OTHER;
+        break;
+    }
+    entries->push_back(entry);
+  }
+
+  uv_fs_req_cleanup(&req);
+  return 0;
+}
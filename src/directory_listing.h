@@ -0,0 +1,26 @@
+#ifndef SRC_DIRECTORY_LISTING_H_
+#define SRC_DIRECTORY_LISTING_H_
+
+#include <string>
+#include <vector>
+
+enum ENTRY_TYPE {
+  ENTRY_OTHER = 0,
+  ENTRY_FILE = 1,
+  ENTRY_DIRECTORY = 2,
+  // Combined with the type of the symlink's target, ENTRY_OTHER if the link
+  // is broken.
+  ENTRY_SYMLINK = 4,
+};
+
+struct DirectoryEntry {
+  std::string name;
+  int type;
+};
+
+// Lists |path| with the type of each entry. Types come from the directory
+// itself where the file system provides them, only symlinks and entries of
+// unknown type are stat'ed. Returns 0 or a negative libuv error code.
+int ListDirectory(const std::string& path, std::vector<DirectoryEntry>* entries);
+
+#endif  // SRC_DIRECTORY_LISTING_H_
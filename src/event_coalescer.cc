@@ -0,0 +1,150 @@
+#include "event_coalescer.h"
+
+#include <algorithm>
+
+static bool IsCoalescable(EVENT_TYPE type) {
+  return type == EVENT_CHANGE || type == EVENT_CHILD_CHANGE;
+}
+
+bool EventCoalescer::Key::operator<(const Key& other) const {
+  std::less<WatcherHandle> less;
+  if (less(handle, other.handle))
+    return true;
+  if (less(other.handle, handle))
+    return false;
+  if (type != other.type)
+    return type < other.type;
+  return path < other.path;
+}
+
+EventCoalescer::EventCoalescer()
+    : next_sequence_(0) {
+  uv_mutex_init(&mutex_);
+}
+
+EventCoalescer::~EventCoalescer() {
+  uv_mutex_destroy(&mutex_);
+}
+
+void EventCoalescer::SetWindow(WatcherHandle handle, int window_ms) {
+  ScopedLocker locker(mutex_);
+  if (window_ms <= 0)
+    windows_.erase(handle);
+  else
+    windows_[handle] = window_ms;
+}
+
+void EventCoalescer::RemoveHandle(WatcherHandle handle) {
+  ScopedLocker locker(mutex_);
+  windows_.erase(handle);
+
+  Key first = { handle, EVENT_NONE, std::vector<char>() };
+  PendingMap::iterator iter = pending_.lower_bound(first);
+  while (iter != pending_.end() && iter->first.handle == handle)
+    pending_.erase(iter++);
+}
+
+void EventCoalescer::Add(WatcherEvent* event, std::vector<WatcherEvent>* ready) {
+  ScopedLocker locker(mutex_);
+
+  int window_ms = WindowFor(event->handle);
+  if (window_ms == 0 && pending_.empty()) {
+    ready->push_back(std::move(*event));
+    return;
+  }
+
+  if (window_ms == 0 || !IsCoalescable(event->type)) {
+    // Whatever is pending for the handle happened before this event.
+    FlushHandle(event->handle, ready);
+    ready->push_back(std::move(*event));
+    return;
+  }
+
+  Key key = { event->handle, event->type, event->new_path };
+  PendingMap::iterator iter = pending_.find(key);
+  if (iter != pending_.end()) {
+    WatcherEvent& merged = iter->second.event;
+    merged.count += event->count;
+    merged.stat = event->stat;
+    // Appended bytes are read once each, so those of the merged events make
+    // up what was appended over the window.
+    if (merged.tail == TAIL_RELOAD || event->tail == TAIL_RELOAD) {
+      merged.tail = TAIL_RELOAD;
+      merged.appended.clear();
+    } else if (event->tail == TAIL_APPENDED) {
+      merged.tail = TAIL_APPENDED;
+      merged.appended += event->appended;
+    }
+    return;
+  }
+
+  Pending pending;
+  pending.deadline = uv_hrtime() + static_cast<uint64_t>(window_ms) * 1000000;
+  pending.sequence = next_sequence_++;
+  pending.event = std::move(*event);
+  pending_.insert(std::make_pair(key, std::move(pending)));
+}
+
+void EventCoalescer::Flush(std::vector<WatcherEvent>* ready) {
+  ScopedLocker locker(mutex_);
+
+  uint64_t now = uv_hrtime();
+  std::vector<PendingMap::iterator> expired;
+  for (PendingMap::iterator iter = pending_.begin();
+       iter != pending_.end();
+       ++iter) {
+    if (iter->second.deadline <= now)
+      expired.push_back(iter);
+  }
+  TakeInOrder(&expired, ready);
+}
+
+int EventCoalescer::Timeout() {
+  ScopedLocker locker(mutex_);
+  if (pending_.empty())
+    return -1;
+
+  uint64_t deadline = pending_.begin()->second.deadline;
+  for (PendingMap::const_iterator iter = pending_.begin();
+       iter != pending_.end();
+       ++iter)
+    deadline = std::min(deadline, iter->second.deadline);
+
+  uint64_t now = uv_hrtime();
+  if (deadline <= now)
+    return 0;
+  // Round up so that the wait does not end just before the deadline.
+  return static_cast<int>((deadline - now + 999999) / 1000000);
+}
+
+int EventCoalescer::WindowFor(WatcherHandle handle) const {
+  std::map<WatcherHandle, int>::const_iterator iter = windows_.find(handle);
+  return iter == windows_.end() ? 0 : iter->second;
+}
+
+void EventCoalescer::FlushHandle(WatcherHandle handle,
+                                 std::vector<WatcherEvent>* ready) {
+  Key first = { handle, EVENT_NONE, std::vector<char>() };
+  std::vector<PendingMap::iterator> entries;
+  for (PendingMap::iterator iter = pending_.lower_bound(first);
+       iter != pending_.end() && iter->first.handle == handle;
+       ++iter)
+    entries.push_back(iter);
+  TakeInOrder(&entries, ready);
+}
+
+void EventCoalescer::TakeInOrder(std::vector<PendingMap::iterator>* entries,
+                                 std::vector<WatcherEvent>* ready) {
+  struct Earlier {
+    bool operator()(const PendingMap::iterator& a,
+                    const PendingMap::iterator& b) const {
+      return a->second.sequence < b->second.sequence;
+    }
+  };
+  std::sort(entries->begin(), entries->end(), Earlier());
+
+  for (size_t i = 0; i < entries->size(); ++i) {
+    ready->push_back(std::move((*entries)[i]->second.event));
+    pending_.erase((*entries)[i]);
+  }
+}
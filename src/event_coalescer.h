@@ -0,0 +1,62 @@
+#ifndef SRC_EVENT_COALESCER_H_
+#define SRC_EVENT_COALESCER_H_
+
+#include <functional>
+#include <map>
+#include <vector>
+
+#include "common.h"
+
+// Merges repeated change events of a handle that arrive within its window
+// into one event carrying the number of merged events. Only used by the
+// watcher threads, the main thread just configures the windows.
+class EventCoalescer {
+ public:
+  EventCoalescer();
+  ~EventCoalescer();
+
+  // Window in milliseconds, 0 disables coalescing for the handle.
+  void SetWindow(WatcherHandle handle, int window_ms);
+  // Forgets the handle's window and drops its pending events.
+  void RemoveHandle(WatcherHandle handle);
+
+  // Takes |event|, appending whatever has to be delivered right away to
+  // |ready|, in order.
+  void Add(WatcherEvent* event, std::vector<WatcherEvent>* ready);
+  // Appends the events whose window has closed to |ready|.
+  void Flush(std::vector<WatcherEvent>* ready);
+  // Milliseconds until the next window closes, or -1 if nothing is pending.
+  int Timeout();
+
+ private:
+  struct Key {
+    WatcherHandle handle;
+    EVENT_TYPE type;
+    std::vector<char> path;
+
+    bool operator<(const Key& other) const;
+  };
+
+  struct Pending {
+    uint64_t deadline;
+    uint64_t sequence;
+    WatcherEvent event;
+  };
+
+  typedef std::map<Key, Pending> PendingMap;
+
+  int WindowFor(WatcherHandle handle) const;
+  void FlushHandle(WatcherHandle handle, std::vector<WatcherEvent>* ready);
+  void TakeInOrder(std::vector<PendingMap::iterator>* entries,
+                   std::vector<WatcherEvent>* ready);
+
+  uv_mutex_t mutex_;
+  std::map<WatcherHandle, int> windows_;
+  PendingMap pending_;
+  uint64_t next_sequence_;
+
+  EventCoalescer(const EventCoalescer&);
+  void operator=(const EventCoalescer&);
+};
+
+#endif  // SRC_EVENT_COALESCER_H_
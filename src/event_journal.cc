@@ -0,0 +1,78 @@
+#include "event_journal.h"
+
+#include <algorithm>
+#include <chrono>
+#include <utility>
+
+static double WallClockMs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count() / 1e3;
+}
+
+EventJournal::EventJournal()
+    : enabled_(false),
+      capacity_(0),
+      start_(0),
+      size_(0),
+      next_sequence_(1) {
+  uv_mutex_init(&mutex_);
+}
+
+EventJournal::~EventJournal() {
+  uv_mutex_destroy(&mutex_);
+}
+
+void EventJournal::SetCapacity(size_t capacity) {
+  ScopedLocker locker(mutex_);
+  // Entries are kept in order, the newest ones if there is not enough room.
+  std::vector<JournalEntry> ring;
+  size_t keep = std::min(size_, capacity);
+  for (size_t i = size_ - keep; i < size_; ++i)
+    ring.push_back(std::move(ring_[(start_ + i) % ring_.size()]));
+  ring_.swap(ring);
+  capacity_ = capacity;
+  start_ = 0;
+  size_ = keep;
+  enabled_.store(capacity > 0, std::memory_order_relaxed);
+}
+
+void EventJournal::Append(const WatcherEvent& event) {
+  if (!enabled())
+    return;
+
+  ScopedLocker locker(mutex_);
+  if (capacity_ == 0)
+    return;
+
+  JournalEntry* entry;
+  if (size_ < capacity_) {
+    ring_.push_back(JournalEntry());
+    entry = &ring_.back();
+    ++size_;
+  } else {
+    // Full, the oldest entry makes room and its paths' memory is reused.
+    entry = &ring_[start_];
+    start_ = (start_ + 1) % capacity_;
+  }
+  entry->sequence = next_sequence_++;
+  entry->time = WallClockMs();
+  entry->event = event;
+}
+
+bool EventJournal::Since(uint64_t sequence,
+                         size_t max_count,
+                         std::vector<JournalEntry>* entries,
+                         uint64_t* last) {
+  ScopedLocker locker(mutex_);
+  *last = next_sequence_ - 1;
+  uint64_t oldest = next_sequence_ - size_;
+  if (sequence + 1 < oldest)
+    return false;
+
+  size_t skip = static_cast<size_t>(std::min<uint64_t>(sequence + 1 - oldest, size_));
+  size_t count = std::min(size_ - skip, max_count);
+  entries->reserve(count);
+  for (size_t i = skip; i < skip + count; ++i)
+    entries->push_back(ring_[(start_ + i) % ring_.size()]);
+  return true;
+}
@@ -0,0 +1,57 @@
+#ifndef SRC_EVENT_JOURNAL_H_
+#define SRC_EVENT_JOURNAL_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <vector>
+
+#include "common.h"
+
+struct JournalEntry {
+  uint64_t sequence;
+  // Wall clock milliseconds since the epoch when the entry was recorded.
+  double time;
+  WatcherEvent event;
+};
+
+// Ring of the last events of an environment, numbered with increasing
+// sequence numbers, for consumers that pull changes at their own pace rather
+// than keep up with the callback. Watcher threads append, the environment's
+// thread reads.
+class EventJournal {
+ public:
+  EventJournal();
+  ~EventJournal();
+
+  // Keeps the last |capacity| events, 0 turns the journal off and forgets
+  // them. Sequence numbers keep counting from where they were.
+  void SetCapacity(size_t capacity);
+  bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+  void Append(const WatcherEvent& event);
+
+  // Copies up to |max_count| entries with a sequence number above |sequence|
+  // to |entries|. Returns false, copying nothing, if some of them have been
+  // evicted already. |last| is set to the sequence number of the newest
+  // event either way.
+  bool Since(uint64_t sequence,
+             size_t max_count,
+             std::vector<JournalEntry>* entries,
+             uint64_t* last);
+
+ private:
+  uv_mutex_t mutex_;
+  std::atomic<bool> enabled_;
+  std::vector<JournalEntry> ring_;
+  size_t capacity_;
+  // Index of the oldest entry, and the number of entries.
+  size_t start_;
+  size_t size_;
+  uint64_t next_sequence_;
+
+  EventJournal(const EventJournal&);
+  void operator=(const EventJournal&);
+};
+
+#endif  // SRC_EVENT_JOURNAL_H_
@@ -0,0 +1,339 @@
+#include "file_reader.h"
+
+#include <string.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
+#include <uv.h>
+
+#include "digest.h"
+
+// Read after the file's stat size is reached, to find out whether it ended or
+// grew since.
+static const size_t kTailChunkSize = 64 * 1024;
+// Largest single read, which libuv takes as an unsigned int.
+static const size_t kMaxReadSize = 1 << 30;
+
+static const uint16_t kReplacementCharacter = 0xfffd;
+
+static bool IsAscii(const char* data, size_t length) {
+  const char* end = data + length;
+  // A word at a time, the high bit of any byte makes it non-ASCII.
+  for (; data + sizeof(uint64_t) <= end; data += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    if (word & 0x8080808080808080ULL)
+      return false;
+  }
+  for (; data < end; ++data) {
+    if (*data & 0x80)
+      return false;
+  }
+  return true;
+}
+
+// Whether |bytes| hold no sequence that DecodeUtf8 would replace.
+static bool IsValidUtf8(const std::string& bytes) {
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(bytes.data());
+  const uint8_t* end = p + bytes.size();
+  while (p < end) {
+    uint8_t byte = *p++;
+    if (byte < 0x80)
+      continue;
+
+    int needed;
+    uint8_t lower = 0x80, upper = 0xbf;
+    if (byte >= 0xc2 && byte <= 0xdf) {
+      needed = 1;
+    } else if (byte >= 0xe0 && byte <= 0xef) {
+      if (byte == 0xe0)
+        lower = 0xa0;
+      else if (byte == 0xed)
+        upper = 0x9f;
+      needed = 2;
+    } else if (byte >= 0xf0 && byte <= 0xf4) {
+      if (byte == 0xf0)
+        lower = 0x90;
+      else if (byte == 0xf4)
+        upper = 0x8f;
+      needed = 3;
+    } else {
+      return false;
+    }
+
+    for (; needed > 0; --needed, ++p) {
+      if (p == end || *p < lower || *p > upper)
+        return false;
+      lower = 0x80;
+      upper = 0xbf;
+    }
+  }
+  return true;
+}
+
+template <bool kWrite>
+static inline void PutUnit(uint16_t* out, size_t* length, uint16_t unit) {
+  if (kWrite)
+    out[*length] = unit;
+  ++*length;
+}
+
+// Decodes UTF-8 as the WHATWG Encoding Standard specifies, replacing each
+// maximal invalid subsequence by U+FFFD like V8's decoder. Returns the number
+// of UTF-16 units, which are written to |out| only when |kWrite| is set.
+template <bool kWrite>
+static size_t DecodeUtf8Units(const std::string& bytes, uint16_t* out) {
+  size_t length = 0;
+
+  const uint8_t* p = reinterpret_cast<const uint8_t*>(bytes.data());
+  const uint8_t* end = p + bytes.size();
+  uint32_t code_point = 0;
+  int needed = 0, seen = 0;
+  uint8_t lower = 0x80, upper = 0xbf;
+  while (p < end) {
+    if (needed == 0) {
+      // Runs of ASCII, which most text is made of, are copied a word at a
+      // time.
+      while (p + sizeof(uint64_t) <= end) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        if (word & 0x8080808080808080ULL)
+          break;
+        if (kWrite) {
+          for (size_t i = 0; i < sizeof(word); ++i)
+            out[length + i] = p[i];
+        }
+        length += sizeof(word);
+        p += sizeof(word);
+      }
+      if (p == end)
+        break;
+
+      uint8_t byte = *p++;
+      if (byte < 0x80) {
+        PutUnit<kWrite>(out, &length, byte);
+      } else if (byte >= 0xc2 && byte <= 0xdf) {
+        needed = 1;
+        code_point = byte & 0x1f;
+      } else if (byte >= 0xe0 && byte <= 0xef) {
+        if (byte == 0xe0)
+          lower = 0xa0;
+        else if (byte == 0xed)
+          upper = 0x9f;
+        needed = 2;
+        code_point = byte & 0x0f;
+      } else if (byte >= 0xf0 && byte <= 0xf4) {
+        if (byte == 0xf0)
+          lower = 0x90;
+        else if (byte == 0xf4)
+          upper = 0x8f;
+        needed = 3;
+        code_point = byte & 0x07;
+      } else {
+        PutUnit<kWrite>(out, &length, kReplacementCharacter);
+      }
+      continue;
+    }
+
+    uint8_t byte = *p;
+    if (byte < lower || byte > upper) {
+      // The sequence ends short, and the byte starts the next one.
+      code_point = needed = seen = 0;
+      lower = 0x80;
+      upper = 0xbf;
+      PutUnit<kWrite>(out, &length, kReplacementCharacter);
+      continue;
+    }
+
+    ++p;
+    lower = 0x80;
+    upper = 0xbf;
+    code_point = (code_point << 6) | (byte & 0x3f);
+    if (++seen < needed)
+      continue;
+
+    if (code_point >= 0x10000) {
+      code_point -= 0x10000;
+      PutUnit<kWrite>(out, &length,
+                      static_cast<uint16_t>(0xd800 + (code_point >> 10)));
+      PutUnit<kWrite>(out, &length,
+                      static_cast<uint16_t>(0xdc00 + (code_point & 0x3ff)));
+    } else {
+      PutUnit<kWrite>(out, &length, static_cast<uint16_t>(code_point));
+    }
+    code_point = needed = seen = 0;
+  }
+  if (needed > 0)
+    PutUnit<kWrite>(out, &length, kReplacementCharacter);
+  return length;
+}
+
+// Counts the units first, so that the buffer V8 takes over is no larger than
+// the text instead of twice the size of the bytes.
+static void DecodeUtf8(const std::string& bytes, std::vector<uint16_t>* utf16) {
+  utf16->resize(DecodeUtf8Units<false>(bytes, NULL));
+  DecodeUtf8Units<true>(bytes, utf16->data());
+}
+
+static int ReadFd(uv_file fd, size_t max_size, std::string* bytes) {
+  uv_fs_t req;
+  int r = uv_fs_fstat(NULL, &req, fd, NULL);
+  if (r < 0)
+    return r;
+  bool is_directory = (req.statbuf.st_mode & S_IFMT) == S_IFDIR;
+  uint64_t size = req.statbuf.st_size;
+  uv_fs_req_cleanup(&req);
+  if (is_directory)
+    return UV_EISDIR;
+  if (size > max_size)
+    return UV_EFBIG;
+
+  bytes->resize(size);
+  size_t length = 0;
+  while (length < bytes->size()) {
+    size_t read_size = std::min(bytes->size() - length, kMaxReadSize);
+    uv_buf_t buf = uv_buf_init(&(*bytes)[length], static_cast<unsigned int>(read_size));
+    r = uv_fs_read(NULL, &req, fd, &buf, 1, -1, NULL);
+    uv_fs_req_cleanup(&req);
+    if (r < 0)
+      return r;
+    if (r == 0) {
+      // Truncated while it was read.
+      bytes->resize(length);
+      return 0;
+    }
+    length += r;
+  }
+
+  // Appended to while it was read, or a file like those of /proc which has
+  // no size until it is read.
+  char chunk[kTailChunkSize];
+  uv_buf_t buf = uv_buf_init(chunk, sizeof(chunk));
+  while ((r = uv_fs_read(NULL, &req, fd, &buf, 1, -1, NULL)) > 0) {
+    uv_fs_req_cleanup(&req);
+    if (bytes->size() + r > max_size)
+      return UV_EFBIG;
+    bytes->append(chunk, r);
+  }
+  uv_fs_req_cleanup(&req);
+  return r;
+}
+
+int ReadWholeFile(const std::string& path, size_t max_size, std::string* bytes) {
+  uv_fs_t req;
+  uv_file fd = uv_fs_open(NULL, &req, path.c_str(), UV_FS_O_RDONLY, 0, NULL);
+  uv_fs_req_cleanup(&req);
+  if (fd < 0)
+    return fd;
+
+  int r = ReadFd(fd, max_size, bytes);
+  uv_fs_close(NULL, &req, fd, NULL);
+  uv_fs_req_cleanup(&req);
+  return r;
+}
+
+static int StatRegularFile(uv_file fd, uint64_t* ino, uint64_t* size) {
+  uv_fs_t req;
+  int r = uv_fs_fstat(NULL, &req, fd, NULL);
+  if (r < 0) {
+    uv_fs_req_cleanup(&req);
+    return r;
+  }
+  bool is_regular = (req.statbuf.st_mode & S_IFMT) == S_IFREG;
+  *ino = req.statbuf.st_ino;
+  *size = req.statbuf.st_size;
+  uv_fs_req_cleanup(&req);
+  return is_regular ? 0 : UV_EINVAL;
+}
+
+int GetTailPosition(const std::string& path, TailPosition* position) {
+  uv_fs_t req;
+  uv_file fd = uv_fs_open(NULL, &req, path.c_str(), UV_FS_O_RDONLY, 0, NULL);
+  uv_fs_req_cleanup(&req);
+  if (fd < 0)
+    return fd;
+
+  int r = StatRegularFile(fd, &position->ino, &position->offset);
+  uv_fs_close(NULL, &req, fd, NULL);
+  uv_fs_req_cleanup(&req);
+  return r;
+}
+
+int ReadAppended(const std::string& path,
+                 size_t max_size,
+                 TailPosition* position,
+                 std::string* appended,
+                 bool* reload) {
+  uv_fs_t req;
+  uv_file fd = uv_fs_open(NULL, &req, path.c_str(), UV_FS_O_RDONLY, 0, NULL);
+  uv_fs_req_cleanup(&req);
+  if (fd < 0)
+    return fd;
+
+  uint64_t ino, size;
+  int r = StatRegularFile(fd, &ino, &size);
+  *reload = r == 0 &&
+      (ino != position->ino || size < position->offset ||
+       size - position->offset > max_size);
+  if (r == 0 && !*reload && size > position->offset) {
+    // Only up to the size seen, what is appended meanwhile comes with the
+    // next event.
+    appended->resize(size - position->offset);
+    size_t length = 0;
+    while (length < appended->size()) {
+      uv_buf_t buf = uv_buf_init(&(*appended)[length],
+                                 static_cast<unsigned int>(appended->size() - length));
+      r = uv_fs_read(NULL, &req, fd, &buf, 1, position->offset + length, NULL);
+      uv_fs_req_cleanup(&req);
+      if (r <= 0)
+        break;
+      length += r;
+    }
+    appended->resize(length);
+    // Truncated while it was read.
+    if (r == 0 && length < size - position->offset)
+      *reload = true;
+  }
+  uv_fs_close(NULL, &req, fd, NULL);
+  uv_fs_req_cleanup(&req);
+  if (r < 0)
+    return r;
+
+  if (*reload) {
+    appended->clear();
+    position->ino = ino;
+    position->offset = size;
+  } else {
+    position->offset += appended->size();
+  }
+  return 0;
+}
+
+int ReadFileText(const std::string& path,
+                 size_t max_size,
+                 size_t decode_size,
+                 bool digest,
+                 FileText* text) {
+  int r = ReadWholeFile(path, max_size, &text->bytes);
+  if (r < 0)
+    return r;
+  bool decode = text->bytes.size() >= decode_size;
+  if (!decode && !digest)
+    return 0;
+
+  bool ascii = IsAscii(text->bytes.data(), text->bytes.size());
+  if (digest && (ascii || IsValidUtf8(text->bytes)))
+    text->digest = Sha1Hex(text->bytes.data(), text->bytes.size());
+  if (!decode)
+    return 0;
+
+  if (ascii) {
+    text->form = FileText::FORM_ONE_BYTE;
+  } else {
+    DecodeUtf8(text->bytes, &text->utf16);
+    std::string().swap(text->bytes);
+    text->form = FileText::FORM_TWO_BYTE;
+  }
+  return 0;
+}
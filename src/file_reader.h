@@ -0,0 +1,68 @@
+#ifndef SRC_FILE_READER_H_
+#define SRC_FILE_READER_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// Text of a file read from UTF-8, in the form it is handed to V8 in.
+struct FileText {
+  enum FORM {
+    // |bytes| still have to be decoded from UTF-8.
+    FORM_UTF8,
+    // |bytes| are all ASCII, which is also Latin-1.
+    FORM_ONE_BYTE,
+    // |utf16| holds the decoded text and |bytes| are released.
+    FORM_TWO_BYTE,
+  };
+
+  FileText() : form(FORM_UTF8) {}
+
+  FORM form;
+  std::string bytes;
+  std::vector<uint16_t> utf16;
+  // SHA-1 of the bytes read, when asked for and they are valid UTF-8. Only
+  // then they are the UTF-8 encoding of the text, so that it is also the
+  // digest of the text.
+  std::string digest;
+};
+
+// Reads the whole of |path| into |bytes|, sized by fstat so that a file
+// which does not change while it is read takes a single allocation. Returns 0
+// or a negative libuv error code, UV_EFBIG for files of more than |max_size|
+// bytes. Safe to call from any thread.
+int ReadWholeFile(const std::string& path, size_t max_size, std::string* bytes);
+
+// Reads |path| into |text|, decoding it when it is at least |decode_size|
+// bytes long, and hashing the bytes read when |digest| is set. Invalid UTF-8 is
+// replaced by U+FFFD the same way V8 does, so the result does not depend on
+// where it was decoded.
+int ReadFileText(const std::string& path,
+                 size_t max_size,
+                 size_t decode_size,
+                 bool digest,
+                 FileText* text);
+
+// Where a followed file has been read up to.
+struct TailPosition {
+  uint64_t ino;
+  uint64_t offset;
+};
+
+// Sets |position| to the end of the regular file |path|. Returns 0 or a
+// negative libuv error code.
+int GetTailPosition(const std::string& path, TailPosition* position);
+
+// Reads what was appended to |path| past |position| into |appended| and moves
+// |position| to the end of the file. Sets |reload| instead, reading nothing,
+// when the file was replaced or truncated since, or grew by more than
+// |max_size| bytes, as then it has to be read again from the start. Returns 0
+// or a negative libuv error code.
+int ReadAppended(const std::string& path,
+                 size_t max_size,
+                 TailPosition* position,
+                 std::string* appended,
+                 bool* reload);
+
+#endif  // SRC_FILE_READER_H_
@@ -1,6 +1,7 @@
 #include "handle_map.h"
 
 #include <algorithm>
+#include <utility>
 
 HandleMap::HandleMap() {
 }
@@ -9,24 +10,61 @@ HandleMap::~HandleMap() {
   Clear();
 }
 
-bool HandleMap::Has(WatcherHandle key) const {
-  return map_.find(key) != map_.end();
+HandleMap::Entry* HandleMap::Find(WatcherHandle key) {
+#ifdef _WIN32
+  std::unordered_map<WatcherHandle, size_t>::const_iterator iter =
+      slots_.find(key);
+  return iter == slots_.end() ? NULL : &entries_[iter->second];
+#else
+  if (key < 0 || static_cast<size_t>(key) >= slots_.size() || slots_[key] == 0)
+    return NULL;
+  return &entries_[slots_[key] - 1];
+#endif
+}
+
+void HandleMap::SetSlot(WatcherHandle key, size_t slot) {
+#ifdef _WIN32
+  slots_[key] = slot;
+#else
+  if (static_cast<size_t>(key) >= slots_.size())
+    slots_.resize(std::max(slots_.size() * 2, static_cast<size_t>(key) + 1), 0);
+  slots_[key] = slot + 1;
+#endif
+}
+
+void HandleMap::ClearSlot(WatcherHandle key) {
+#ifdef _WIN32
+  slots_.erase(key);
+#else
+  slots_[key] = 0;
+#endif
+}
+
+void HandleMap::Insert(WatcherHandle key, Local<Value> value) {
+  entries_.push_back(Entry(key, value));
+  SetSlot(key, entries_.size() - 1);
 }
 
 bool HandleMap::Erase(WatcherHandle key) {
-  Map::iterator iter = map_.find(key);
-  if (iter == map_.end())
+  Entry* entry = Find(key);
+  if (entry == NULL)
     return false;
 
-  NanDisposeUnsafePersistent(iter->second);
-  map_.erase(iter);
+  entry->value.Reset();
+  // Keep the entries contiguous by moving the last one into the hole.
+  size_t slot = entry - &entries_[0];
+  if (slot != entries_.size() - 1) {
+    *entry = std::move(entries_.back());
+    SetSlot(entry->key, slot);
+  }
+  entries_.pop_back();
+  ClearSlot(key);
   return true;
 }
 
 void HandleMap::Clear() {
-  for (Map::iterator iter = map_.begin(); iter != map_.end(); ++iter)
-    NanDisposeUnsafePersistent(iter->second);
-  map_.clear();
+  entries_.clear();
+  slots_.clear();
 }
 
 // static
@@ -49,7 +87,7 @@ NAN_METHOD(HandleMap::Add) {
   if (obj->Has(key))
     return Nan::ThrowError("Duplicate key");
 
-  NanAssignUnsafePersistent(obj->map_[key], info[1]);
+  obj->Insert(key, info[1]);
   return;
 }
 
@@ -61,11 +99,26 @@ NAN_METHOD(HandleMap::Get) {
     return Nan::ThrowTypeError("Bad argument");
 
   HandleMap* obj = Nan::ObjectWrap::Unwrap<HandleMap>(info.This());
-  WatcherHandle key = V8ValueToWatcherHandle(info[0]);
-  if (!obj->Has(key))
+  Entry* entry = obj->Find(V8ValueToWatcherHandle(info[0]));
+  if (entry == NULL)
     return Nan::ThrowError("Invalid key");
 
-  info.GetReturnValue().Set(NanUnsafePersistentToLocal(obj->map_[key]));
+  info.GetReturnValue().Set(Nan::New(entry->value));
+}
+
+// static
+NAN_METHOD(HandleMap::Find) {
+  Nan::HandleScope scope;
+
+  if (!IsV8ValueWatcherHandle(info[0]))
+    return Nan::ThrowTypeError("Bad argument");
+
+  HandleMap* obj = Nan::ObjectWrap::Unwrap<HandleMap>(info.This());
+  Entry* entry = obj->Find(V8ValueToWatcherHandle(info[0]));
+  if (entry == NULL)
+    return info.GetReturnValue().SetUndefined();
+
+  info.GetReturnValue().Set(Nan::New(entry->value));
 }
 
 // static
@@ -85,18 +138,45 @@ NAN_METHOD(HandleMap::Values) {
 
   HandleMap* obj = Nan::ObjectWrap::Unwrap<HandleMap>(info.This());
 
-  int i = 0;
   v8::Local<v8::Context> context = Nan::GetCurrentContext();
-  v8::Local<Array> keys = Nan::New<Array>(obj->map_.size());
-  for (Map::const_iterator iter = obj->map_.begin();
-       iter != obj->map_.end();
-       ++iter, ++i) {
-    keys->Set(context, i, NanUnsafePersistentToLocal(iter->second)).FromJust();
-  }
+  v8::Local<Array> keys = Nan::New<Array>(obj->entries_.size());
+  for (size_t i = 0; i < obj->entries_.size(); ++i)
+    keys->Set(context, i, Nan::New(obj->entries_[i].value)).FromJust();
 
   info.GetReturnValue().Set(keys);
 }
 
+// static
+NAN_METHOD(HandleMap::ForEach) {
+  Nan::HandleScope scope;
+
+  if (!info[0]->IsFunction())
+    return Nan::ThrowTypeError("Function required");
+
+  HandleMap* obj = Nan::ObjectWrap::Unwrap<HandleMap>(info.This());
+  Local<Function> callback = info[0].As<Function>();
+
+  // The callback may add or remove entries, so walk a copy of the keys and
+  // skip the ones removed meanwhile.
+  std::vector<WatcherHandle> keys;
+  keys.reserve(obj->entries_.size());
+  for (size_t i = 0; i < obj->entries_.size(); ++i)
+    keys.push_back(obj->entries_[i].key);
+
+  for (size_t i = 0; i < keys.size(); ++i) {
+    Entry* entry = obj->Find(keys[i]);
+    if (entry == NULL)
+      continue;
+
+    Local<Value> argv[] = {
+      Nan::New(entry->value),
+      WatcherHandleToV8Value(keys[i]),
+    };
+    if (Nan::Call(callback, info.This(), 2, argv).IsEmpty())
+      return;  // Let the exception propagate.
+  }
+}
+
 // static
 NAN_METHOD(HandleMap::Remove) {
   Nan::HandleScope scope;
@@ -121,6 +201,12 @@ NAN_METHOD(HandleMap::Clear) {
   return;
 }
 
+// static
+NAN_GETTER(HandleMap::Size) {
+  HandleMap* obj = Nan::ObjectWrap::Unwrap<HandleMap>(info.This());
+  info.GetReturnValue().Set(static_cast<uint32_t>(obj->entries_.size()));
+}
+
 // static
 void HandleMap::Initialize(Local<Object> target) {
   Nan::HandleScope scope;
@@ -131,10 +217,15 @@ void HandleMap::Initialize(Local<Object> target) {
 
   Nan::SetPrototypeMethod(t, "add", Add);
   Nan::SetPrototypeMethod(t, "get", Get);
+  Nan::SetPrototypeMethod(t, "find", Find);
   Nan::SetPrototypeMethod(t, "has", Has);
   Nan::SetPrototypeMethod(t, "values", Values);
+  Nan::SetPrototypeMethod(t, "forEach", ForEach);
   Nan::SetPrototypeMethod(t, "remove", Remove);
   Nan::SetPrototypeMethod(t, "clear", Clear);
+  Nan::SetAccessor(t->InstanceTemplate(),
+                   Nan::New<String>("size").ToLocalChecked(),
+                   Size);
 
   Local<v8::Context> context = Nan::GetCurrentContext();
   target->Set(context,
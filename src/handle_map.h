@@ -1,36 +1,67 @@
 #ifndef SRC_HANDLE_MAP_H_
 #define SRC_HANDLE_MAP_H_
 
-#include <map>
+#include <vector>
+#ifdef _WIN32
+#include <unordered_map>
+#endif
 
 #include "common.h"
-#include "unsafe_persistent.h"
 
+// Values are kept contiguously and looked up through an index from handle to
+// slot. On POSIX the handles are small integers, so the index is a plain
+// vector; Windows handles are pointers and use a hash table instead. Entries
+// are only ever moved, as every copy of a persistent handle would be another
+// strong reference to the value.
 class HandleMap : public Nan::ObjectWrap {
  public:
   static void Initialize(Local<Object> target);
 
  private:
-  typedef std::map<WatcherHandle, NanUnsafePersistent<Value> > Map;
+  struct Entry {
+    Entry(WatcherHandle key, Local<Value> value) : key(key), value(value) {}
+    Entry(Entry&& other) : key(other.key), value(std::move(other.value)) {}
+    Entry& operator=(Entry&& other) {
+      key = other.key;
+      value = std::move(other.value);
+      return *this;
+    }
+
+    WatcherHandle key;
+    Nan::Global<Value> value;
+  };
 
   HandleMap();
   virtual ~HandleMap();
 
-  bool Has(WatcherHandle key) const;
+  // Returns the entry of |key|, or NULL.
+  Entry* Find(WatcherHandle key);
+  bool Has(WatcherHandle key) { return Find(key) != NULL; }
+  void Insert(WatcherHandle key, Local<Value> value);
   bool Erase(WatcherHandle key);
   void Clear();
 
-  static void DisposeHandle(NanUnsafePersistent<Value>& value);
+  void SetSlot(WatcherHandle key, size_t slot);
+  void ClearSlot(WatcherHandle key);
 
   static NAN_METHOD(New);
   static NAN_METHOD(Add);
   static NAN_METHOD(Get);
+  static NAN_METHOD(Find);
   static NAN_METHOD(Has);
   static NAN_METHOD(Values);
+  static NAN_METHOD(ForEach);
   static NAN_METHOD(Remove);
   static NAN_METHOD(Clear);
+  static NAN_GETTER(Size);
 
-  Map map_;
+  std::vector<Entry> entries_;
+#ifdef _WIN32
+  std::unordered_map<WatcherHandle, size_t> slots_;
+#else
+  // Slot + 1 of each handle, 0 for handles not in the map.
+  std::vector<size_t> slots_;
+#endif
 };
 
 #endif  // SRC_HANDLE_MAP_H_
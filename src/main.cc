@@ -3,17 +3,41 @@
 
 namespace {
 
-void Init(Local<Object> exports) {
-  CommonInit();
-  PlatformInit();
+NAN_MODULE_INIT(Init) {
+  // Methods that need the state of their environment get it as data.
+  Local<Value> env = CommonInit();
 
-  Nan::SetMethod(exports, "setCallback", SetCallback);
-  Nan::SetMethod(exports, "watch", Watch);
-  Nan::SetMethod(exports, "unwatch", Unwatch);
+  Nan::SetMethod(target, "setCallback", SetCallback, env);
+  Nan::SetMethod(target, "setBatchCallback", SetBatchCallback, env);
+  Nan::SetMethod(target, "setCoalesceWindow", SetCoalesceWindow, env);
+  Nan::SetMethod(target, "enableJournal", EnableJournal, env);
+  Nan::SetMethod(target, "changesSince", ChangesSince, env);
+  Nan::SetMethod(target, "watch", Watch, env);
+  Nan::SetMethod(target, "unwatch", Unwatch, env);
+  Nan::SetMethod(target, "watchMany", WatchMany, env);
+  Nan::SetMethod(target, "watchAsync", WatchAsync, env);
+  Nan::SetMethod(target, "unwatchMany", UnwatchMany, env);
+  Nan::SetMethod(target, "getWatchLimits", GetWatchLimits);
+  Nan::SetMethod(target, "setWatchBudget", SetWatchBudget);
+  Nan::SetMethod(target, "getPolledWatches", GetPolledWatches);
+  Nan::SetMethod(target, "simulateOverflow", SimulateOverflow);
+  Nan::SetMethod(target, "getStats", GetStats);
+  Nan::SetMethod(target, "resetStats", ResetStats);
+  Nan::SetMethod(target, "digest", Digest);
+  Nan::SetMethod(target, "digestSync", DigestSync);
+  Nan::SetMethod(target, "readFile", ReadFile);
+  Nan::SetMethod(target, "readFileSync", ReadFileSync);
+  Nan::SetMethod(target, "diffBlocks", DiffBlocks);
+  Nan::SetMethod(target, "diffBlocksSync", DiffBlocksSync);
+  Nan::SetMethod(target, "diffWatchBlocks", DiffWatchBlocks, env);
+  Nan::SetMethod(target, "readdirWithTypes", ReaddirWithTypes);
+  Nan::SetMethod(target, "readdirWithTypesSync", ReaddirWithTypesSync);
+  Nan::SetMethod(target, "writeTreeSnapshot", WriteTreeSnapshot);
+  Nan::SetMethod(target, "diffTreeSnapshot", DiffTreeSnapshot);
 
-  HandleMap::Initialize(exports);
+  HandleMap::Initialize(target);
 }
 
 }  // namespace
 
-NODE_MODULE(pathwatcher, Init)
+NAN_MODULE_WORKER_ENABLED(pathwatcher, Init)
@@ -0,0 +1,218 @@
+#include "path_filter.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+
+PathFilter::PathFilter(const std::vector<std::string>& include,
+                       const std::vector<std::string>& exclude,
+                       uint32_t event_mask,
+                       bool ignore_attributes)
+    : include_(Compile(include)),
+      exclude_(Compile(exclude)),
+      event_mask_(event_mask),
+      ignore_attributes_(ignore_attributes) {
+  char flags[32];
+  snprintf(flags, sizeof(flags), "%x|%d", event_mask_, ignore_attributes_ ? 1 : 0);
+  key_ = flags;
+  for (size_t i = 0; i < include.size(); ++i)
+    key_ += "|+" + include[i];
+  for (size_t i = 0; i < exclude.size(); ++i)
+    key_ += "|-" + exclude[i];
+}
+
+bool PathFilter::AcceptsEvent(int type, const std::string& path) const {
+  if ((event_mask_ & (1u << type)) == 0)
+    return false;
+  if (path.empty())
+    return true;
+  if (Matches(exclude_, path))
+    return false;
+  return include_.empty() || Matches(include_, path);
+}
+
+bool PathFilter::ExcludesDirectory(const std::string& path) const {
+  return Matches(exclude_, path);
+}
+
+// static
+std::vector<PathFilter::Pattern> PathFilter::Compile(
+    const std::vector<std::string>& globs) {
+  std::vector<Pattern> patterns;
+  for (size_t i = 0; i < globs.size(); ++i) {
+    std::string glob = globs[i];
+    // Separators at the ends only say that the pattern is anchored or names a
+    // directory.
+    while (glob.size() > 1 && glob[glob.size() - 1] == '/')
+      glob.resize(glob.size() - 1);
+    bool component = glob.find('/') == std::string::npos;
+    while (!glob.empty() && glob[0] == '/')
+      glob.erase(0, 1);
+    if (glob.empty())
+      continue;
+
+    Pattern pattern = { Tokenize(glob), component };
+    patterns.push_back(pattern);
+  }
+  return patterns;
+}
+
+// static
+std::vector<PathFilter::Token> PathFilter::Tokenize(const std::string& glob) {
+  std::vector<Token> tokens;
+  const char* pattern = glob.c_str();
+  while (*pattern != '\0') {
+    Token token = { Token::TOKEN_LITERAL, *pattern, false, std::string() };
+    switch (*pattern) {
+      case '*': {
+        bool any_depth = pattern[1] == '*';
+        while (*pattern == '*')
+          ++pattern;
+        if (any_depth && *pattern == '/') {
+          Token skip = { Token::TOKEN_SKIP, '\0', false, std::string() };
+          tokens.push_back(skip);
+        }
+        token.kind = any_depth ? Token::TOKEN_GLOBSTAR : Token::TOKEN_STAR;
+        break;
+      }
+      case '?':
+        token.kind = Token::TOKEN_ANY;
+        ++pattern;
+        break;
+      case '[': {
+        const char* p = pattern + 1;
+        token.negate = *p == '!' || *p == '^';
+        if (token.negate)
+          ++p;
+        // A ']' right after the '[' is part of the set.
+        for (const char* first = p; *p != '\0' && (*p != ']' || p == first); ++p) {
+          token.ranges += *p;
+          if (p[1] == '-' && p[2] != '\0' && p[2] != ']')
+            p += 2;
+          token.ranges += *p;
+        }
+        if (*p != ']') {
+          // Unterminated, treat the '[' literally.
+          token.negate = false;
+          token.ranges.clear();
+          ++pattern;
+          break;
+        }
+        token.kind = Token::TOKEN_SET;
+        pattern = p + 1;
+        break;
+      }
+      case '\\':
+        // Escaped character.
+        if (pattern[1] != '\0')
+          ++pattern;
+        token.literal = *pattern++;
+        break;
+      default:
+        ++pattern;
+        break;
+    }
+    tokens.push_back(token);
+  }
+  return tokens;
+}
+
+// static
+bool PathFilter::TokenMatches(const Token& token, char c) {
+  switch (token.kind) {
+    case Token::TOKEN_LITERAL:
+      return token.literal == c;
+    case Token::TOKEN_ANY:
+    case Token::TOKEN_STAR:
+      return c != '/';
+    case Token::TOKEN_SET: {
+      if (c == '/')
+        return false;
+      bool matched = false;
+      for (size_t i = 0; i < token.ranges.size() && !matched; i += 2)
+        matched = token.ranges[i] <= c && c <= token.ranges[i + 1];
+      return matched != token.negate;
+    }
+    case Token::TOKEN_GLOBSTAR:
+      return true;
+    case Token::TOKEN_SKIP:
+      return false;
+  }
+  return false;
+}
+
+// Adds the positions reached from those in |states| without reading a
+// character, by letting a star match nothing.
+// static
+void PathFilter::FollowEmptyMatches(const std::vector<Token>& tokens,
+                                    std::vector<char>* states) {
+  // Empty matches only ever move forward, so one pass reaches them all.
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    if (!(*states)[i])
+      continue;
+    const Token& token = tokens[i];
+    if (token.kind == Token::TOKEN_STAR ||
+        token.kind == Token::TOKEN_GLOBSTAR ||
+        token.kind == Token::TOKEN_SKIP)
+      (*states)[i + 1] = true;
+    if (token.kind == Token::TOKEN_SKIP)
+      (*states)[i + 3] = true;
+  }
+}
+
+// static
+bool PathFilter::Matches(const std::vector<Pattern>& patterns,
+                         const std::string& path) {
+  for (size_t i = 0; i < patterns.size(); ++i) {
+    if (Matches(patterns[i], path))
+      return true;
+  }
+  return false;
+}
+
+// Globs are matched by following every position of the pattern that the text
+// read so far can have reached at once, so that a run of stars costs the
+// length of the pattern per character instead of backtracking over each star.
+// static
+bool PathFilter::Matches(const Pattern& pattern, const std::string& path) {
+  // Every component, or every leading part of the path, is tried so that the
+  // children of a matching directory match too. The leading parts are all
+  // prefixes of one walk through the path, components each start a new one.
+  const std::vector<Token>& tokens = pattern.tokens;
+  std::vector<char> states(tokens.size() + 1), next(tokens.size() + 1);
+  bool restart = true;
+  for (size_t i = 0; ; ++i) {
+    if (restart) {
+      std::fill(states.begin(), states.end(), false);
+      states[0] = true;
+      FollowEmptyMatches(tokens, &states);
+      restart = false;
+    }
+
+    bool at_end = i == path.size();
+    if ((at_end || path[i] == '/') && states[tokens.size()])
+      return true;
+    if (at_end)
+      return false;
+    if (pattern.component && path[i] == '/') {
+      restart = true;
+      continue;
+    }
+
+    std::fill(next.begin(), next.end(), false);
+    bool alive = false;
+    for (size_t t = 0; t < tokens.size(); ++t) {
+      if (!states[t] || !TokenMatches(tokens[t], path[i]))
+        continue;
+      // Stars stay in place to match more.
+      bool repeats = tokens[t].kind == Token::TOKEN_STAR ||
+                     tokens[t].kind == Token::TOKEN_GLOBSTAR;
+      next[repeats ? t : t + 1] = true;
+      alive = true;
+    }
+    if (!alive && !pattern.component)
+      return false;
+    FollowEmptyMatches(tokens, &next);
+    states.swap(next);
+  }
+}
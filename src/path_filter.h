@@ -0,0 +1,80 @@
+#ifndef SRC_PATH_FILTER_H_
+#define SRC_PATH_FILTER_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// Decides on the watcher threads which events of a watch are delivered. Paths
+// are matched relative to the watched path with '/' as separator. Patterns
+// support '*', '**', '?' and '[...]'; a pattern without a '/' matches any
+// component of the path, and a path is excluded when any of its parent
+// directories is. Filters are immutable once built, so they can be shared by
+// threads.
+class PathFilter {
+ public:
+  // |event_mask| has the bit (1 << type) set for every EVENT_TYPE to deliver.
+  PathFilter(const std::vector<std::string>& include,
+             const std::vector<std::string>& exclude,
+             uint32_t event_mask,
+             bool ignore_attributes);
+
+  // |path| is empty for events of the watched path itself.
+  bool AcceptsEvent(int type, const std::string& path) const;
+  // Whether a recursive watch should skip the directory at |path|.
+  bool ExcludesDirectory(const std::string& path) const;
+  // Whether changes of attributes only, like the modification time, are
+  // dropped.
+  bool ignore_attributes() const { return ignore_attributes_; }
+
+  // Identifies filters that behave the same.
+  const std::string& key() const { return key_; }
+
+ private:
+  // One step of a compiled glob.
+  struct Token {
+    enum KIND {
+      TOKEN_LITERAL,
+      // '?', any character but '/'.
+      TOKEN_ANY,
+      // '[...]', |ranges| holds pairs of first and last character.
+      TOKEN_SET,
+      // '*', any run of characters but '/'.
+      TOKEN_STAR,
+      // '**', any run of characters.
+      TOKEN_GLOBSTAR,
+      // Put before a '**/' to skip all of it, so that "a/**/b" also matches
+      // "a/b". Matches no character itself.
+      TOKEN_SKIP,
+    };
+
+    KIND kind;
+    char literal;
+    bool negate;
+    std::string ranges;
+  };
+
+  struct Pattern {
+    std::vector<Token> tokens;
+    // Matched against each component rather than the whole path.
+    bool component;
+  };
+
+  static std::vector<Pattern> Compile(const std::vector<std::string>& globs);
+  static std::vector<Token> Tokenize(const std::string& glob);
+  static bool Matches(const std::vector<Pattern>& patterns,
+                      const std::string& path);
+  static bool Matches(const Pattern& pattern, const std::string& path);
+  static bool TokenMatches(const Token& token, char c);
+  static void FollowEmptyMatches(const std::vector<Token>& tokens,
+                                 std::vector<char>* states);
+
+  std::vector<Pattern> include_;
+  std::vector<Pattern> exclude_;
+  uint32_t event_mask_;
+  bool ignore_attributes_;
+  std::string key_;
+};
+
+#endif  // SRC_PATH_FILTER_H_
@@ -0,0 +1,157 @@
+#include "path_poller.h"
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <utility>
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && defined(STATX_INO)
+static uint64_t ToNanoseconds(const struct statx_timestamp& time) {
+  return static_cast<uint64_t>(time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+#else
+static uint64_t ToNanoseconds(const uv_timespec_t& time) {
+  return static_cast<uint64_t>(time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+#endif
+
+static void AddChange(std::vector<TreeChange>* changes, EVENT_TYPE type) {
+  TreeChange change = { type, std::string() };
+  changes->push_back(change);
+}
+
+PathPoller::PathPoller(const std::string& path, bool recursive)
+    : path_(path),
+      recursive_(recursive),
+      started_(false),
+      exists_(false),
+      is_directory_(false) {
+  size_t slash = path_.rfind('/');
+  if (slash != std::string::npos && slash + 1 < path_.size()) {
+    parent_ = slash == 0 ? "/" : path_.substr(0, slash);
+    name_ = path_.substr(slash + 1);
+  }
+  version_.ino = version_.size = version_.mtime_ns = version_.ctime_ns = 0;
+}
+
+int PathPoller::Stat(int dirfd, Version* version, bool* is_directory) const {
+  // Symlinks are followed, as inotify_add_watch does.
+#if defined(__linux__) && defined(STATX_INO)
+  // Only what is compared, which saves network file systems fetching the
+  // rest.
+  struct statx st;
+  int r = dirfd == -1 ?
+      statx(AT_FDCWD, path_.c_str(), 0,
+            STATX_TYPE | STATX_INO | STATX_SIZE | STATX_MTIME | STATX_CTIME, &st) :
+      statx(dirfd, name_.c_str(), 0,
+            STATX_TYPE | STATX_INO | STATX_SIZE | STATX_MTIME | STATX_CTIME, &st);
+  if (r == -1)
+    return -errno;
+  version->ino = st.stx_ino;
+  version->size = st.stx_size;
+  version->mtime_ns = ToNanoseconds(st.stx_mtime);
+  version->ctime_ns = ToNanoseconds(st.stx_ctime);
+  *is_directory = S_ISDIR(st.stx_mode);
+  return 0;
+#else
+  uv_fs_t req;
+  int r = uv_fs_stat(NULL, &req, path_.c_str(), NULL);
+  if (r < 0) {
+    uv_fs_req_cleanup(&req);
+    return r;
+  }
+  uv_stat_t stat = req.statbuf;
+  uv_fs_req_cleanup(&req);
+  version->ino = stat.st_ino;
+  version->size = stat.st_size;
+  version->mtime_ns = ToNanoseconds(stat.st_mtim);
+  version->ctime_ns = ToNanoseconds(stat.st_ctim);
+  *is_directory = (stat.st_mode & S_IFMT) == S_IFDIR;
+  return 0;
+#endif
+}
+
+void PathPoller::Poll(std::vector<TreeChange>* changes) {
+  Poll(-1, changes);
+}
+
+void PathPoller::Poll(int dirfd, std::vector<TreeChange>* changes) {
+  Version version = { 0, 0, 0, 0 };
+  bool is_directory = false;
+  bool exists = Stat(dirfd, &version, &is_directory) == 0;
+  bool compare = started_ && exists_ && exists && is_directory_ == is_directory;
+
+  if (started_ && exists_ && !exists)
+    AddChange(changes, EVENT_DELETE);
+  else if (started_ && !exists_ && exists)
+    AddChange(changes, EVENT_RESURRECT);
+
+  if (is_directory) {
+    TreeSnapshot next;
+    next.Scan(path_, compare ? &snapshot_ : NULL, compare ? changes : NULL,
+              recursive_);
+    std::swap(snapshot_, next);
+  } else {
+    snapshot_ = TreeSnapshot();
+  }
+
+  if (compare && !is_directory &&
+      (version.ino != version_.ino || version.size != version_.size ||
+       version.mtime_ns != version_.mtime_ns || version.ctime_ns != version_.ctime_ns))
+    AddChange(changes, EVENT_CHANGE);
+  else if (started_ && exists_ && exists && is_directory_ != is_directory)
+    AddChange(changes, EVENT_CHANGE);
+
+  started_ = true;
+  exists_ = exists;
+  is_directory_ = is_directory;
+  version_ = version;
+}
+
+bool PathPoller::ChangedSince(uint64_t time_ns) const {
+  return version_.mtime_ns >= time_ns || version_.ctime_ns >= time_ns ||
+      snapshot_.LatestMtime() >= time_ns;
+}
+
+// static
+void PathPoller::PollAll(const std::vector<PathPoller*>& pollers,
+                         std::vector<std::vector<TreeChange> >* changes) {
+  changes->resize(pollers.size());
+
+  std::vector<std::pair<const std::string*, size_t> > order;
+  order.reserve(pollers.size());
+  for (size_t i = 0; i < pollers.size(); ++i)
+    order.push_back(std::make_pair(&pollers[i]->parent_, i));
+  std::sort(order.begin(), order.end(),
+            [](const std::pair<const std::string*, size_t>& a,
+               const std::pair<const std::string*, size_t>& b) {
+              return *a.first < *b.first;
+            });
+
+  for (size_t i = 0; i < order.size();) {
+    const std::string& parent = *order[i].first;
+    size_t end = i + 1;
+    while (end < order.size() && *order[end].first == parent)
+      ++end;
+
+    int dirfd = -1;
+#ifdef __linux__
+    if (end - i > 1 && !parent.empty())
+      dirfd = open(parent.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+#endif
+    for (; i < end; ++i) {
+      size_t index = order[i].second;
+      pollers[index]->Poll(dirfd, &(*changes)[index]);
+    }
+#ifdef __linux__
+    if (dirfd != -1)
+      close(dirfd);
+#endif
+  }
+}
@@ -0,0 +1,63 @@
+#ifndef SRC_PATH_POLLER_H_
+#define SRC_PATH_POLLER_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "tree_snapshot.h"
+
+// Finds out what changed at a path by comparing it with what it looked like
+// the last time, for watches that get no notifications from the kernel. Files
+// are compared by stat, directories with a TreeSnapshot of their entries, or
+// of the whole tree below them when |recursive|.
+class PathPoller {
+ public:
+  PathPoller(const std::string& path, bool recursive);
+
+  // Looks at the path again and appends the changes since the last call to
+  // |changes|: child events for the entries of directories, EVENT_CHANGE for
+  // files, EVENT_DELETE once the path is gone and EVENT_RESURRECT when it
+  // exists again, with an empty path for the watched path itself. The first
+  // call only takes the baseline.
+  void Poll(std::vector<TreeChange>* changes);
+
+  // Polls each of |pollers| into the same index of |changes|. Paths of the
+  // same directory are stat'ed relative to one descriptor of it, so that the
+  // kernel does not walk the directory's path again for each of them.
+  static void PollAll(const std::vector<PathPoller*>& pollers,
+                      std::vector<std::vector<TreeChange> >* changes);
+
+  bool started() const { return started_; }
+  bool exists() const { return exists_; }
+  // Whether the path, or anything below it that was looked at, was modified
+  // at |time_ns| (since the epoch) or later when it was last polled.
+  bool ChangedSince(uint64_t time_ns) const;
+
+ private:
+  struct Version {
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime_ns;
+    uint64_t ctime_ns;
+  };
+
+  // Stats the path, relative to |dirfd| unless it is -1. Returns 0 or a
+  // negative errno.
+  int Stat(int dirfd, Version* version, bool* is_directory) const;
+  void Poll(int dirfd, std::vector<TreeChange>* changes);
+
+  std::string path_;
+  // The parent directory and name of |path_|.
+  std::string parent_;
+  std::string name_;
+  bool recursive_;
+  bool started_;
+  bool exists_;
+  bool is_directory_;
+  Version version_;
+  TreeSnapshot snapshot_;
+};
+
+#endif  // SRC_PATH_POLLER_H_
@@ -1,82 +1,1138 @@
+#include <dirent.h>
 #include <errno.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/inotify.h>
+#include <sys/stat.h>
 #include <linux/limits.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <queue>
+#include <string>
+#include <utility>
 
 #include "common.h"
+#include "path_poller.h"
+
+// The read buffer starts at this size and grows to whatever the kernel has
+// queued, so that a burst of events is drained with a single read.
+static const size_t kMinReadBufferSize = 64 * 1024;
+
+static const uint32_t kWatchMask = IN_ATTRIB | IN_CREATE | IN_DELETE |
+    IN_MODIFY | IN_MOVE | IN_MOVE_SELF | IN_DELETE_SELF;
+
+// Handles given out to JS are not inotify watch descriptors: a recursive watch
+// owns one descriptor per directory, and inotify returns the same descriptor
+// when two paths resolve to the same inode. Freed handles are reused in FIFO
+// order only after this many have piled up, so a late event for a closed
+// handle does not reach the watcher that got its number.
+static const size_t kHandleReuseDelay = 64;
+
+// Files are saved atomically by renaming a new file over them, or by deleting
+// them and creating them again. A watched file that disappears is reported
+// deleted only if its name does not come back within this many milliseconds.
+static const int kReplaceGracePeriodMs = 100;
+
+// The two halves of a rename are queued together, but a read can end between
+// them. A move whose other half is not in the same read waits for the next
+// read, or this many milliseconds, before it is reported as a move out of the
+// watched directories.
+static const int kMoveTimeoutMs = 20;
+
+// fs.inotify.max_user_watches is shared by every program of the user, this
+// part of it is left to the others.
+static const int64_t kReservedWatchesDivisor = 8;
+// When the budget is used up, watches are moved to polling until this part
+// of it is free again, so that the next watches fit without picking more.
+static const size_t kBudgetSlackDivisor = 16;
+// Polled watches are looked at again kMinPollIntervalMs after they changed,
+// and twice as late every time they did not, up to kMaxPollIntervalMs.
+static const int kMinPollIntervalMs = 250;
+static const int kMaxPollIntervalMs = 4000;
+// Polls due within this many milliseconds of each other are done together.
+static const int kPollSlackMs = 50;
+// After a round of polls the poller thread rests this many times as long as
+// the round took, which bounds it to a small share of a core however many
+// paths are polled: they are polled less often instead.
+static const uint64_t kPollRestFactor = 50;
+// Watches polled from the start take their baseline on the poller thread. A
+// path modified this long before the watch was set up, or later, may have
+// changed after watch() returned, since file system timestamps lag behind the
+// clock and those of network file systems come from another machine's clock.
+static const uint64_t kBaselineSlackNs = 2000000000ull;
+
+// One user of an inotify watch descriptor, with the path the descriptor has
+// in that watch.
+struct Subscription {
+  WatcherHandle handle;
+  std::string path;
+};
+
+struct WatchState {
+  WatcherHandle handle;
+  // Distinguishes this watch from an older one that had the same handle.
+  uint64_t serial;
+  bool recursive;
+  int root_wd;
+  std::string path;
+  // Watch on the parent directory of a watched file, to see it replaced.
+  int parent_wd;
+  std::string name;
+  // When the file went away, 0 while it exists.
+  uint64_t vanished_at;
+  // Keep watching the parent once the file is reported deleted.
+  bool resurrect;
+  bool deleted;
+  std::shared_ptr<const PathFilter> filter;
+  // Subdirectories of a recursive watch, by path.
+  std::map<std::string, int> dirs;
+  // uv_hrtime() of the last event, the least recently active watches are
+  // the ones polled when the budget runs out.
+  uint64_t active_at;
+  // Set once the watch is polled instead, which it is until it is closed.
+  // Only the poller thread uses it.
+  std::shared_ptr<PathPoller> poller;
+  int poll_interval_ms;
+  // uv_hrtime() of the next poll, 0 while it is being polled.
+  uint64_t poll_at;
+  // Report EVENT_RESCAN once polling has its baseline, for watches that may
+  // have missed changes while they were moved.
+  bool rescan_on_baseline;
+  // Wall clock time the watch was set up at, in nanoseconds since the epoch.
+  uint64_t watched_at_ns;
+};
+
+// Directory tree to be walked by the watcher thread.
+struct ScanRequest {
+  WatcherHandle handle;
+  uint64_t serial;
+  std::string path;
+  // Whether to report the entries found as created, which is the case for
+  // directories that appeared after the watch was set up.
+  bool report;
+};
+
+// A child moved away from a directory, waiting for the IN_MOVED_TO with the
+// same cookie to turn it into a rename.
+struct PendingMove {
+  uint32_t cookie;
+  WatcherHandle handle;
+  std::string path;
+  bool is_dir;
+  // uv_hrtime() of the read it came with.
+  uint64_t read_at;
+};
+
+// A poll due at |at|, stale if the watch was closed or rescheduled since.
+struct PollSchedule {
+  uint64_t at;
+  WatcherHandle handle;
+  uint64_t serial;
+
+  bool operator>(const PollSchedule& other) const { return at > other.at; }
+};
+
+typedef std::map<int, std::vector<Subscription> > DescriptorMap;
+typedef std::map<WatcherHandle, WatchState> WatchMap;
 
 static int g_inotify;
+static int g_wakeup;
 static int g_init_errno;
 
+// Guards everything below, shared by the main thread and the watcher thread.
+static uv_mutex_t g_mutex;
+static DescriptorMap g_descriptors;
+static WatchMap g_watches;
+static std::deque<WatcherHandle> g_free_handles;
+static WatcherHandle g_next_handle = 1;
+static uint64_t g_next_serial = 1;
+static std::vector<ScanRequest> g_scan_requests;
+// Descriptors this process may use, lowered when the kernel runs out of them
+// first.
+static size_t g_watch_budget = SIZE_MAX;
+static std::priority_queue<PollSchedule,
+                           std::vector<PollSchedule>,
+                           std::greater<PollSchedule> > g_poll_schedule;
+// Signaled when a poll is scheduled.
+static uv_cond_t g_poll_cond;
+static uv_thread_t g_poll_thread;
+static bool g_poll_thread_started;
+// Set by PlatformSimulateOverflow until the watcher thread handles it.
+static bool g_overflow_requested;
+
+static int64_t ReadProcValue(const char* path) {
+  FILE* file = fopen(path, "r");
+  if (file == NULL)
+    return -1;
+
+  long long value;
+  int matched = fscanf(file, "%lld", &value);
+  fclose(file);
+  return matched == 1 ? value : -1;
+}
+
+static size_t DefaultWatchBudget() {
+  int64_t limit = ReadProcValue("/proc/sys/fs/inotify/max_user_watches");
+  if (limit <= 0)
+    return SIZE_MAX;
+  return static_cast<size_t>(limit - limit / kReservedWatchesDivisor);
+}
+
 void PlatformInit() {
-  g_inotify = inotify_init();
+  uv_mutex_init(&g_mutex);
+  uv_cond_init(&g_poll_cond);
+  g_watch_budget = DefaultWatchBudget();
+
+  g_inotify = inotify_init1(IN_CLOEXEC);
   if (g_inotify == -1) {
     g_init_errno = errno;
     return;
   }
 
+  g_wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (g_wakeup == -1) {
+    g_init_errno = errno;
+    close(g_inotify);
+    g_inotify = -1;
+    return;
+  }
+
   WakeupNewThread();
 }
 
-void PlatformThread() {
-  // Needs to be large enough for sizeof(inotify_event) + strlen(filename).
-  char buf[4096];
+static void WakeupWatcherThread() {
+  uint64_t value = 1;
+  while (write(g_wakeup, &value, sizeof(value)) == -1 && errno == EINTR) {}
+}
 
-  while (true) {
-    int size;
-    do {
-      size = read(g_inotify, buf, sizeof(buf));
-    } while (size == -1 && errno == EINTR);
+static WatcherHandle AllocateHandle() {
+  if (g_free_handles.size() > kHandleReuseDelay) {
+    WatcherHandle handle = g_free_handles.front();
+    g_free_handles.pop_front();
+    return handle;
+  }
+  return g_next_handle++;
+}
 
-    if (size == -1) {
-      break;
-    } else if (size == 0) {
+static WatchState* FindWatch(WatcherHandle handle, uint64_t serial = 0) {
+  WatchMap::iterator iter = g_watches.find(handle);
+  if (iter == g_watches.end())
+    return NULL;
+  if (serial != 0 && iter->second.serial != serial)
+    return NULL;
+  return &iter->second;
+}
+
+// Whether a recursive watch should leave the directory at |path| out.
+static bool IsExcludedDirectory(const WatchState* watch, const std::string& path) {
+  if (!watch->filter || path.size() <= watch->path.size())
+    return false;
+  return watch->filter->ExcludesDirectory(path.substr(watch->path.size() + 1));
+}
+
+// Changes of the metadata only, like the modification time or permissions.
+static bool IsIgnoredAttributeChange(const WatchState* watch, uint32_t mask) {
+  return (mask & IN_ATTRIB) && !(mask & IN_MODIFY) &&
+      watch->filter && watch->filter->ignore_attributes();
+}
+
+static bool IsPathOrChildOf(const std::string& path, const std::string& parent) {
+  return path.compare(0, parent.size(), parent) == 0 &&
+      (path.size() == parent.size() || path[parent.size()] == '/');
+}
+
+static std::vector<char> ToVector(const std::string& str) {
+  return std::vector<char>(str.begin(), str.end());
+}
+
+static void Unsubscribe(int wd, WatcherHandle handle) {
+  DescriptorMap::iterator iter = g_descriptors.find(wd);
+  if (iter == g_descriptors.end())
+    return;
+
+  // The order of the subscriptions does not matter, and a parent directory can
+  // have thousands of them.
+  std::vector<Subscription>& subs = iter->second;
+  for (size_t i = 0; i < subs.size(); ++i) {
+    if (subs[i].handle == handle) {
+      std::swap(subs[i], subs.back());
+      subs.pop_back();
       break;
     }
+  }
+
+  if (subs.empty()) {
+    inotify_rm_watch(g_inotify, wd);
+    g_descriptors.erase(iter);
+  }
+}
+
+static void PollThread(void* arg);
+
+static void SchedulePoll(WatchState* watch, uint64_t at) {
+  watch->poll_at = at;
+  PollSchedule entry = { at, watch->handle, watch->serial };
+  g_poll_schedule.push(entry);
+  uv_cond_signal(&g_poll_cond);
+}
+
+// Moves |watch| from inotify to polling, which frees the descriptors nobody
+// else uses. What happened until the first poll is unknown, so an existing
+// watch is told to rescan then.
+static void StartPolling(WatchState* watch, bool rescan) {
+  if (watch->poller)
+    return;
+
+  if (watch->root_wd != -1)
+    Unsubscribe(watch->root_wd, watch->handle);
+  if (watch->parent_wd != -1)
+    Unsubscribe(watch->parent_wd, watch->handle);
+  for (std::map<std::string, int>::const_iterator iter = watch->dirs.begin();
+       iter != watch->dirs.end();
+       ++iter)
+    Unsubscribe(iter->second, watch->handle);
+  watch->root_wd = -1;
+  watch->parent_wd = -1;
+  watch->dirs.clear();
+  watch->vanished_at = 0;
+
+  watch->poller = std::make_shared<PathPoller>(watch->path, watch->recursive);
+  watch->rescan_on_baseline = rescan;
+  watch->poll_interval_ms = kMinPollIntervalMs;
+  if (!g_poll_thread_started) {
+    g_poll_thread_started = true;
+    uv_thread_create(&g_poll_thread, &PollThread, NULL);
+  }
+  // Without a baseline, the sooner the first poll the better.
+  SchedulePoll(watch, uv_hrtime());
+}
+
+// Whether |wd| is used by no other watch than |handle|, so that polling it
+// would free the descriptor.
+static bool IsOnlySubscriber(int wd, WatcherHandle handle) {
+  DescriptorMap::const_iterator iter = g_descriptors.find(wd);
+  if (iter == g_descriptors.end())
+    return false;
+
+  const std::vector<Subscription>& subs = iter->second;
+  for (size_t i = 0; i < subs.size(); ++i) {
+    if (subs[i].handle != handle)
+      return false;
+  }
+  return true;
+}
+
+static bool FreesDescriptors(const WatchState& watch) {
+  if (IsOnlySubscriber(watch.root_wd, watch.handle) ||
+      IsOnlySubscriber(watch.parent_wd, watch.handle))
+    return true;
+  for (std::map<std::string, int>::const_iterator iter = watch.dirs.begin();
+       iter != watch.dirs.end();
+       ++iter) {
+    if (IsOnlySubscriber(iter->second, watch.handle))
+      return true;
+  }
+  return false;
+}
+
+// Polls the least recently active watches other than |keep| until a part of
+// the budget is free, skipping those whose descriptors all stay in use by
+// other watches. Returns false if there is still no room for one more
+// descriptor.
+static bool MakeRoom(WatcherHandle keep) {
+  if (g_watch_budget == 0)
+    return false;
+
+  std::vector<std::pair<uint64_t, WatchState*> > candidates;
+  for (WatchMap::iterator iter = g_watches.begin();
+       iter != g_watches.end();
+       ++iter) {
+    WatchState& watch = iter->second;
+    if (watch.handle != keep && !watch.poller &&
+        (watch.root_wd != -1 || watch.parent_wd != -1 || !watch.dirs.empty()))
+      candidates.push_back(std::make_pair(watch.active_at, &watch));
+  }
+  std::sort(candidates.begin(), candidates.end());
+
+  size_t target = std::min(g_watch_budget - g_watch_budget / kBudgetSlackDivisor,
+                           g_watch_budget - 1);
+  // Whether a watch frees anything depends on the ones polled before it, which
+  // may have shared its descriptors.
+  for (size_t i = 0; i < candidates.size() && g_descriptors.size() > target; ++i) {
+    if (FreesDescriptors(*candidates[i].second))
+      StartPolling(candidates[i].second, true);
+  }
+  return g_descriptors.size() < g_watch_budget;
+}
+
+// inotify_add_watch within the budget, making room when it is used up, or when
+// the kernel runs out of descriptors first because other programs of the user
+// took more than their share. Returns -1 with errno set on failure.
+static int AddWatchDescriptor(const std::string& path,
+                              uint32_t mask,
+                              WatcherHandle keep) {
+  int wd = inotify_add_watch(g_inotify, path.c_str(), mask);
+  if (wd == -1 && errno == ENOSPC && !g_descriptors.empty()) {
+    g_watch_budget = g_descriptors.size();
+    if (!MakeRoom(keep)) {
+      errno = ENOSPC;
+      return -1;
+    }
+    wd = inotify_add_watch(g_inotify, path.c_str(), mask);
+  } else if (wd != -1 && g_descriptors.size() >= g_watch_budget &&
+             g_descriptors.find(wd) == g_descriptors.end()) {
+    // Only a descriptor that is not shared with another watch already takes
+    // from the budget, which inotify tells once it is added.
+    if (!MakeRoom(keep)) {
+      inotify_rm_watch(g_inotify, wd);
+      errno = ENOSPC;
+      return -1;
+    }
+  }
+  return wd;
+}
+
+// Adds a subdirectory to a recursive watch, returns false if it can not be
+// watched or is already part of the watch (a bind mount loop).
+static bool WatchSubdirectory(WatchState* watch, const std::string& path) {
+  if (watch->poller)
+    return false;
+
+  int wd = AddWatchDescriptor(path, kWatchMask | IN_ONLYDIR | IN_DONT_FOLLOW,
+                              watch->handle);
+  if (wd == -1) {
+    // Rather than leaving part of the tree unwatched, the whole tree is
+    // polled.
+    if (errno == ENOSPC)
+      StartPolling(watch, true);
+    return false;
+  }
+
+  std::vector<Subscription>& subs = g_descriptors[wd];
+  for (size_t i = 0; i < subs.size(); ++i) {
+    if (subs[i].handle == watch->handle)
+      return false;
+  }
+
+  Subscription sub = { watch->handle, path };
+  subs.push_back(sub);
+  watch->dirs[path] = wd;
+  return true;
+}
+
+static void AddSubtree(WatchState* watch,
+                       const std::string& path,
+                       std::vector<ScanRequest>* scans) {
+  // Watch the directory before listing it, so that nothing created in it in
+  // the meantime goes unnoticed.
+  if (IsExcludedDirectory(watch, path) || !WatchSubdirectory(watch, path))
+    return;
+
+  ScanRequest request = { watch->handle, watch->serial, path, true };
+  scans->push_back(request);
+}
+
+static void RemoveSubtree(WatchState* watch, const std::string& path) {
+  std::map<std::string, int>::iterator iter = watch->dirs.lower_bound(path);
+  while (iter != watch->dirs.end() &&
+         iter->first.compare(0, path.size(), path) == 0) {
+    if (IsPathOrChildOf(iter->first, path)) {
+      Unsubscribe(iter->second, watch->handle);
+      watch->dirs.erase(iter++);
+    } else {
+      ++iter;
+    }
+  }
+}
+
+static void RenameSubtree(WatchState* watch,
+                          const std::string& from,
+                          const std::string& to) {
+  std::vector<std::pair<std::string, int> > moved;
+  std::map<std::string, int>::iterator iter = watch->dirs.lower_bound(from);
+  while (iter != watch->dirs.end() &&
+         iter->first.compare(0, from.size(), from) == 0) {
+    if (IsPathOrChildOf(iter->first, from)) {
+      moved.push_back(*iter);
+      watch->dirs.erase(iter++);
+    } else {
+      ++iter;
+    }
+  }
+
+  for (size_t i = 0; i < moved.size(); ++i) {
+    std::string path = to + moved[i].first.substr(from.size());
+    watch->dirs[path] = moved[i].second;
+
+    std::vector<Subscription>& subs = g_descriptors[moved[i].second];
+    for (size_t j = 0; j < subs.size(); ++j) {
+      if (subs[j].handle == watch->handle)
+        subs[j].path = path;
+    }
+  }
+}
+
+// The kernel has dropped the descriptor, because its file is gone or it was
+// removed with inotify_rm_watch.
+static void ForgetDescriptor(int wd) {
+  DescriptorMap::iterator iter = g_descriptors.find(wd);
+  if (iter == g_descriptors.end())
+    return;
+
+  for (size_t i = 0; i < iter->second.size(); ++i) {
+    const Subscription& sub = iter->second[i];
+    WatchState* watch = FindWatch(sub.handle);
+    if (watch == NULL)
+      continue;
+    if (watch->root_wd == wd)
+      watch->root_wd = -1;
+    else if (watch->parent_wd == wd)
+      watch->parent_wd = -1;
+    else
+      watch->dirs.erase(sub.path);
+  }
+
+  g_descriptors.erase(iter);
+}
+
+static void StopWatchingParent(WatchState* watch) {
+  if (watch->parent_wd == -1)
+    return;
+  Unsubscribe(watch->parent_wd, watch->handle);
+  watch->parent_wd = -1;
+}
+
+// The watched file is gone, which is only reported once the grace period has
+// passed without the file being created again.
+static void FileVanished(WatchState* watch) {
+  if (watch->vanished_at != 0 || watch->deleted)
+    return;
+
+  if (watch->root_wd != -1) {
+    Unsubscribe(watch->root_wd, watch->handle);
+    watch->root_wd = -1;
+  }
+
+  if (watch->parent_wd == -1) {
+    PostEvent(EVENT_DELETE, watch->handle, std::vector<char>());
+    return;
+  }
+  watch->vanished_at = uv_hrtime();
+}
+
+static void FileDeleted(WatchState* watch) {
+  watch->vanished_at = 0;
+  if (watch->resurrect)
+    watch->deleted = true;
+  else
+    StopWatchingParent(watch);
+  PostEvent(EVENT_DELETE, watch->handle, std::vector<char>());
+}
+
+// A file now has the watched name, watch it instead of the old one.
+static void FileReplaced(WatchState* watch) {
+  if (watch->root_wd != -1)
+    Unsubscribe(watch->root_wd, watch->handle);
+  bool resurrected = watch->deleted;
+  watch->vanished_at = 0;
+
+  watch->root_wd = AddWatchDescriptor(watch->path, kWatchMask, watch->handle);
+  if (watch->root_wd == -1 && errno == ENOSPC) {
+    StartPolling(watch, true);
+    return;
+  } else if (watch->root_wd == -1) {
+    // Gone again already.
+    if (!resurrected)
+      FileDeleted(watch);
+    return;
+  }
+
+  watch->deleted = false;
+  Subscription sub = { watch->handle, watch->path };
+  g_descriptors[watch->root_wd].push_back(sub);
+  PostEvent(resurrected ? EVENT_RESURRECT : EVENT_CHANGE, watch->handle,
+            std::vector<char>());
+}
+
+static void HandleParentEvent(WatchState* watch, const inotify_event* e) {
+  if (e->len == 0 || watch->name != e->name)
+    return;
+
+  if (e->mask & (IN_DELETE | IN_MOVED_FROM))
+    FileVanished(watch);
+  else if (e->mask & IN_MOVED_TO)
+    FileReplaced(watch);
+  else if ((e->mask & IN_CREATE) && (watch->vanished_at != 0 || watch->deleted))
+    FileReplaced(watch);
+}
+
+// Reports the files that did not come back in time as deleted, returns the
+// milliseconds until the next one is due, or -1.
+static int ExpireVanishedFiles() {
+  ScopedEventBatch batch;
+  ScopedLocker locker(g_mutex);
+
+  uint64_t now = uv_hrtime();
+  uint64_t grace = static_cast<uint64_t>(kReplaceGracePeriodMs) * 1000000;
+  int timeout = -1;
+  for (WatchMap::iterator iter = g_watches.begin();
+       iter != g_watches.end();
+       ++iter) {
+    WatchState& watch = iter->second;
+    if (watch.vanished_at == 0)
+      continue;
+
+    if (now - watch.vanished_at >= grace) {
+      FileDeleted(&watch);
+      continue;
+    }
 
-    inotify_event* e;
-    for (char* p = buf; p < buf + size; p += sizeof(*e) + e->len) {
-      e = reinterpret_cast<inotify_event*>(p);
+    int remaining =
+        static_cast<int>((watch.vanished_at + grace - now + 999999) / 1000000);
+    if (timeout == -1 || remaining < timeout)
+      timeout = remaining;
+  }
+  return timeout;
+}
 
-      int fd = e->wd;
-      EVENT_TYPE type;
-      std::vector<char> path;
+static void HandleEvent(const inotify_event* e,
+                        uint64_t now,
+                        std::vector<PendingMove>* moves,
+                        std::vector<ScanRequest>* scans) {
+  if (e->mask & IN_Q_OVERFLOW) {
+    // The kernel queue was full and events are lost, every watch has to find
+    // out what changed on its own.
+    for (WatchMap::const_iterator iter = g_watches.begin();
+         iter != g_watches.end();
+         ++iter)
+      PostEvent(EVENT_RESCAN, iter->first, std::vector<char>());
+    return;
+  }
+
+  if (e->mask & IN_IGNORED) {
+    ForgetDescriptor(e->wd);
+    return;
+  }
+
+  DescriptorMap::const_iterator iter = g_descriptors.find(e->wd);
+  if (iter == g_descriptors.end())
+    return;
+
+  // Copied, since handling the event can change the subscriptions.
+  std::vector<Subscription> subs = iter->second;
+  for (size_t i = 0; i < subs.size(); ++i) {
+    WatchState* watch = FindWatch(subs[i].handle);
+    if (watch == NULL)
+      continue;
+
+    WatcherHandle handle = watch->handle;
+    bool is_root = watch->root_wd == e->wd;
+    watch->active_at = now;
+
+    if (watch->parent_wd == e->wd) {
+      HandleParentEvent(watch, e);
+      continue;
+    }
+
+    if (e->len == 0) {
+      // Subdirectories of a recursive watch also report this to their parent
+      // as a child event, so only the root is interesting here.
+      if (!is_root)
+        continue;
 
       // Note that inotify won't tell us where the file or directory has been
       // moved to, so we just treat IN_MOVE_SELF as file being deleted.
-      if (e->mask & (IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVE)) {
-        type = EVENT_CHANGE;
-      } else if (e->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
-        type = EVENT_DELETE;
+      if (IsIgnoredAttributeChange(watch, e->mask))
+        continue;
+      else if (e->mask & IN_MODIFY)
+        PostEvent(EVENT_CHANGE, handle, std::vector<char>());
+      else if (e->mask & IN_ATTRIB)
+        PostAttributeEvent(EVENT_CHANGE, handle, std::vector<char>());
+      else if (e->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+        FileVanished(watch);
+      continue;
+    }
+
+    std::string path = subs[i].path + '/' + e->name;
+    bool is_dir = (e->mask & IN_ISDIR) != 0;
+    bool track_dir = is_dir && watch->recursive;
+
+    if (e->mask & IN_MOVED_FROM) {
+      PendingMove move = { e->cookie, handle, path, is_dir, now };
+      moves->push_back(move);
+    } else if (e->mask & IN_MOVED_TO) {
+      std::vector<PendingMove>::iterator move = moves->begin();
+      while (move != moves->end() &&
+             !(move->cookie == e->cookie && move->handle == handle))
+        ++move;
+
+      if (move != moves->end()) {
+        if (track_dir)
+          RenameSubtree(watch, move->path, path);
+        PostEvent(EVENT_CHILD_RENAME, handle, ToVector(path),
+                  ToVector(move->path));
+        moves->erase(move);
       } else {
+        if (track_dir)
+          AddSubtree(watch, path, scans);
+        PostEvent(EVENT_CHILD_CREATE, handle, ToVector(path));
+      }
+    } else if (e->mask & IN_CREATE) {
+      if (track_dir)
+        AddSubtree(watch, path, scans);
+      PostEvent(EVENT_CHILD_CREATE, handle, ToVector(path));
+    } else if (e->mask & IN_DELETE) {
+      if (track_dir)
+        RemoveSubtree(watch, path);
+      PostEvent(EVENT_CHILD_DELETE, handle, ToVector(path));
+    } else if (e->mask & IN_MODIFY) {
+      PostEvent(EVENT_CHILD_CHANGE, handle, ToVector(path));
+    } else if ((e->mask & IN_ATTRIB) && !IsIgnoredAttributeChange(watch, e->mask)) {
+      PostAttributeEvent(EVENT_CHILD_CHANGE, handle, ToVector(path));
+    }
+  }
+}
+
+// Handles an overflow that PlatformSimulateOverflow asked for the same way as
+// one reported by the kernel.
+static void HandleRequestedOverflow(std::vector<PendingMove>* moves,
+                                    std::vector<ScanRequest>* scans) {
+  ScopedEventBatch batch;
+  ScopedLocker locker(g_mutex);
+  if (!g_overflow_requested)
+    return;
+  g_overflow_requested = false;
+
+  inotify_event e;
+  memset(&e, 0, sizeof(e));
+  e.wd = -1;
+  e.mask = IN_Q_OVERFLOW;
+  HandleEvent(&e, uv_hrtime(), moves, scans);
+}
+
+// Reports the moves that came with a read before |read_at|, or longer ago
+// than kMoveTimeoutMs, as moves out of the watched directories, since nothing
+// claimed them. Returns the milliseconds until the others time out, or -1.
+static int FlushPendingMoves(std::vector<PendingMove>* moves,
+                             uint64_t read_at,
+                             uint64_t now) {
+  const uint64_t timeout = static_cast<uint64_t>(kMoveTimeoutMs) * 1000000;
+  int remaining = -1;
+  std::vector<PendingMove>::iterator kept = moves->begin();
+  for (std::vector<PendingMove>::iterator move = moves->begin();
+       move != moves->end();
+       ++move) {
+    if (move->read_at >= read_at && now - move->read_at < timeout) {
+      remaining = static_cast<int>((move->read_at + timeout - now + 999999) / 1000000);
+      if (kept != move)
+        *kept = std::move(*move);
+      ++kept;
+      continue;
+    }
+
+    WatchState* watch = FindWatch(move->handle);
+    if (watch == NULL)
+      continue;
+    if (move->is_dir && watch->recursive)
+      RemoveSubtree(watch, move->path);
+    PostEvent(EVENT_CHILD_DELETE, move->handle, ToVector(move->path));
+  }
+  moves->erase(kept, moves->end());
+  return remaining;
+}
+
+// Walks the directory tree of a recursive watch, adding a watch for every
+// subdirectory before listing it.
+static void ScanTree(const ScanRequest& request) {
+  std::vector<std::string> pending(1, request.path);
+  while (!pending.empty()) {
+    std::string dir;
+    dir.swap(pending.back());
+    pending.pop_back();
+
+    DIR* stream = opendir(dir.c_str());
+    if (stream == NULL)
+      continue;
+
+    std::vector<std::pair<std::string, bool> > entries;
+    while (dirent* entry = readdir(stream)) {
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
         continue;
+
+      std::string path = dir + '/' + entry->d_name;
+      bool is_dir = entry->d_type == DT_DIR;
+      if (entry->d_type == DT_UNKNOWN) {
+        struct stat st;
+        is_dir = lstat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
       }
+      entries.push_back(std::make_pair(path, is_dir));
+    }
+    closedir(stream);
 
-      PostEventAndWait(type, fd, path);
+    ScopedEventBatch batch;
+    ScopedLocker locker(g_mutex);
+    WatchState* watch = FindWatch(request.handle, request.serial);
+    if (watch == NULL || watch->poller)
+      return;
+
+    for (size_t i = 0; i < entries.size(); ++i) {
+      if (entries[i].second && !IsExcludedDirectory(watch, entries[i].first) &&
+          WatchSubdirectory(watch, entries[i].first))
+        pending.push_back(entries[i].first);
+      if (request.report)
+        PostEvent(EVENT_CHILD_CREATE, request.handle, ToVector(entries[i].first));
     }
   }
 }
 
-WatcherHandle PlatformWatch(const char* path) {
-  if (g_inotify == -1) {
+static void RunScans(std::vector<ScanRequest>* scans) {
+  {
+    ScopedLocker locker(g_mutex);
+    scans->insert(scans->end(), g_scan_requests.begin(), g_scan_requests.end());
+    g_scan_requests.clear();
+  }
+
+  for (size_t i = 0; i < scans->size(); ++i)
+    ScanTree((*scans)[i]);
+  scans->clear();
+}
+
+// A polled watch, copied to be polled without holding the lock.
+struct PollTarget {
+  WatcherHandle handle;
+  uint64_t serial;
+  std::shared_ptr<PathPoller> poller;
+  bool baseline;
+  // For a baseline of a watch that is not told to rescan anyway, when the
+  // watch was set up.
+  uint64_t watched_at_ns;
+  // Whether the baseline shows changes the watch may have missed.
+  bool missed_changes;
+};
+
+static void PostPolledChanges(WatchState* watch,
+                              bool baseline,
+                              const std::vector<TreeChange>& changes,
+                              uint64_t now) {
+  if (baseline && watch->rescan_on_baseline)
+    PostEvent(EVENT_RESCAN, watch->handle, std::vector<char>());
+  for (size_t i = 0; i < changes.size(); ++i) {
+    const TreeChange& change = changes[i];
+    if (!change.path.empty()) {
+      PostEvent(change.type, watch->handle, ToVector(change.path));
+    } else if (change.type == EVENT_DELETE) {
+      watch->deleted = true;
+      PostEvent(EVENT_DELETE, watch->handle, std::vector<char>());
+    } else if (change.type == EVENT_RESURRECT) {
+      // Only reported to watches that keep waiting for the file.
+      if (watch->deleted && watch->resurrect) {
+        watch->deleted = false;
+        PostEvent(EVENT_RESURRECT, watch->handle, std::vector<char>());
+      }
+    } else if (!watch->deleted) {
+      PostEvent(change.type, watch->handle, std::vector<char>());
+    }
+  }
+  if (!changes.empty())
+    watch->active_at = now;
+}
+
+// Waits, with g_mutex held, until polls are due and the poller thread has
+// rested until |rest_until|, then takes the due polls off the schedule.
+static void TakeDuePolls(uint64_t rest_until, std::vector<PollTarget>* targets) {
+  uint64_t slack = static_cast<uint64_t>(kPollSlackMs) * 1000000;
+  uint64_t now;
+  while (true) {
+    now = uv_hrtime();
+    if (g_poll_schedule.empty()) {
+      uv_cond_wait(&g_poll_cond, &g_mutex);
+      continue;
+    }
+    uint64_t wake_at = std::max(g_poll_schedule.top().at, rest_until);
+    if (wake_at <= now + slack)
+      break;
+    uv_cond_timedwait(&g_poll_cond, &g_mutex, wake_at - now);
+  }
+
+  while (!g_poll_schedule.empty() && g_poll_schedule.top().at <= now + slack) {
+    PollSchedule entry = g_poll_schedule.top();
+    g_poll_schedule.pop();
+
+    WatchState* watch = FindWatch(entry.handle, entry.serial);
+    if (watch == NULL || !watch->poller || watch->poll_at != entry.at)
+      continue;
+    watch->poll_at = 0;
+    // A deleted path is polled for the resurrect option only.
+    if (watch->deleted && !watch->resurrect)
+      continue;
+
+    bool baseline = !watch->poller->started();
+    PollTarget target = { watch->handle, watch->serial, watch->poller, baseline,
+                          baseline && !watch->rescan_on_baseline ? watch->watched_at_ns : 0,
+                          false };
+    targets->push_back(target);
+  }
+}
+
+// Polls the watches that are due in rounds, so that the paths of a directory
+// are stat'ed together, and reschedules them by how recently they changed.
+static void PollThread(void* arg) {
+  uint64_t rest_until = 0;
+  std::vector<PollTarget> targets;
+  std::vector<PathPoller*> pollers;
+  std::vector<std::vector<TreeChange> > changes;
+
+  while (true) {
+    {
+      ScopedLocker locker(g_mutex);
+      TakeDuePolls(rest_until, &targets);
+    }
+
+    uint64_t start = uv_hrtime();
+    for (size_t i = 0; i < targets.size(); ++i)
+      pollers.push_back(targets[i].poller.get());
+    PathPoller::PollAll(pollers, &changes);
+    uint64_t now = uv_hrtime();
+    rest_until = now + (now - start) * kPollRestFactor;
+
+    // What happened between the watch being set up and its baseline is only
+    // told by the timestamps, and by the path being gone.
+    for (size_t i = 0; i < targets.size(); ++i) {
+      PollTarget& target = targets[i];
+      if (target.watched_at_ns == 0)
+        continue;
+      if (!target.poller->exists()) {
+        TreeChange deleted = { EVENT_DELETE, std::string() };
+        changes[i].push_back(deleted);
+      } else {
+        target.missed_changes =
+            target.poller->ChangedSince(target.watched_at_ns - kBaselineSlackNs);
+      }
+    }
+
+    bool posted = false;
+    {
+      ScopedEventBatch batch;
+      ScopedLocker locker(g_mutex);
+      for (size_t i = 0; i < targets.size(); ++i) {
+        WatchState* watch = FindWatch(targets[i].handle, targets[i].serial);
+        if (watch == NULL)
+          continue;
+
+        if (targets[i].missed_changes)
+          watch->rescan_on_baseline = true;
+        PostPolledChanges(watch, targets[i].baseline, changes[i], now);
+        posted = posted || !changes[i].empty() ||
+            (targets[i].baseline && watch->rescan_on_baseline);
+
+        if (!changes[i].empty())
+          watch->poll_interval_ms = kMinPollIntervalMs;
+        else if (!targets[i].baseline)
+          watch->poll_interval_ms = std::min(watch->poll_interval_ms * 2, kMaxPollIntervalMs);
+        SchedulePoll(watch, now + static_cast<uint64_t>(watch->poll_interval_ms) * 1000000);
+      }
+    }
+
+    // Coalesced events are flushed by the watcher thread, which has to know
+    // about them to wake up in time.
+    if (posted)
+      WakeupWatcherThread();
+
+    targets.clear();
+    pollers.clear();
+    changes.clear();
+  }
+}
+
+const char* PlatformName() {
+  return "inotify";
+}
+
+void PlatformThread() {
+  std::vector<char> buf(kMinReadBufferSize);
+
+  std::vector<PendingMove> moves;
+  std::vector<ScanRequest> scans;
+  int vanish_timeout = -1;
+  int move_timeout = -1;
+
+  while (true) {
+    struct pollfd fds[] = {
+      { g_inotify, POLLIN, 0 },
+      { g_wakeup, POLLIN, 0 },
+    };
+    int timeout = PendingEventsTimeout();
+    if (timeout == -1 || (vanish_timeout != -1 && vanish_timeout < timeout))
+      timeout = vanish_timeout;
+    if (timeout == -1 || (move_timeout != -1 && move_timeout < timeout))
+      timeout = move_timeout;
+    if (poll(fds, 2, timeout) == -1) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    if (fds[1].revents & POLLIN) {
+      uint64_t value;
+      while (read(g_wakeup, &value, sizeof(value)) > 0) {}
+      HandleRequestedOverflow(&moves, &scans);
+    }
+
+    if (fds[0].revents & POLLIN) {
+      int available = 0;
+      if (ioctl(g_inotify, FIONREAD, &available) == 0 &&
+          static_cast<size_t>(available) > buf.size())
+        buf.resize(available);
+
+      ssize_t size;
+      do {
+        size = read(g_inotify, buf.data(), buf.size());
+      } while (size == -1 && errno == EINTR);
+
+      if (size == -1) {
+        break;
+      } else if (size == 0) {
+        break;
+      }
+
+      ScopedEventBatch batch;
+      ScopedLocker locker(g_mutex);
+      uint64_t now = uv_hrtime();
+      inotify_event* e;
+      size_t count = 0;
+      for (char* p = buf.data(); p < buf.data() + size; p += sizeof(*e) + e->len) {
+        e = reinterpret_cast<inotify_event*>(p);
+        HandleEvent(e, now, &moves, &scans);
+        ++count;
+      }
+      CountKernelEvents(count, size);
+
+      // Moves left over from the previous read had their chance.
+      move_timeout = FlushPendingMoves(&moves, now, now);
+    } else if (!moves.empty()) {
+      ScopedEventBatch batch;
+      ScopedLocker locker(g_mutex);
+      uint64_t now = uv_hrtime();
+      move_timeout = FlushPendingMoves(&moves, 0, now);
+    }
+
+    RunScans(&scans);
+    vanish_timeout = ExpireVanishedFiles();
+    FlushPendingEvents();
+  }
+}
+
+WatcherHandle PlatformWatch(const char* path, const WatchOptions& options) {
+  if (g_inotify == -1 && !options.poll) {
     return -g_init_errno;
   }
 
-  int fd = inotify_add_watch(g_inotify, path, IN_ATTRIB | IN_CREATE |
-      IN_DELETE | IN_MODIFY | IN_MOVE | IN_MOVE_SELF | IN_DELETE_SELF);
-  if (fd == -1) {
+  // Paths polled on request are stat'ed before locking, as the file systems
+  // they are on can be slow to answer. Their baseline is taken by the poller
+  // thread.
+  struct stat st;
+  if (options.poll && stat(path, &st) != 0)
+    return -errno;
+
+  ScopedLocker locker(g_mutex);
+  int wd = -1;
+  if (!options.poll) {
+    // Handles start at 1, none is kept from being polled.
+    wd = AddWatchDescriptor(path, kWatchMask, 0);
+    if (wd == -1 && errno != ENOSPC)
+      return -errno;
+  }
+
+  // Polled from the start when nothing is left to make room with. The path
+  // has to exist, as for inotify_add_watch.
+  if (wd == -1 && !options.poll && stat(path, &st) != 0)
     return -errno;
+
+  WatcherHandle handle = AllocateHandle();
+  WatchState& watch = g_watches[handle];
+  watch.handle = handle;
+  watch.serial = g_next_serial++;
+  watch.recursive = options.recursive;
+  watch.root_wd = wd;
+  watch.path = path;
+  watch.parent_wd = -1;
+  watch.vanished_at = 0;
+  watch.resurrect = options.resurrect;
+  watch.deleted = false;
+  watch.rescan_on_baseline = false;
+  watch.watched_at_ns = WallClockNs();
+  watch.filter = options.filter;
+  watch.active_at = uv_hrtime();
+  watch.poll_interval_ms = kMinPollIntervalMs;
+  watch.poll_at = 0;
+
+  if (wd == -1) {
+    StartPolling(&watch, false);
+    return handle;
   }
-  return fd;
+
+  Subscription sub = { handle, watch.path };
+  g_descriptors[wd].push_back(sub);
+
+  // Watching the parent directory of a file lets atomic saves be reported as
+  // changes. The descriptor may be shared with a watch of the directory, so it
+  // uses the same mask.
+  size_t slash = watch.path.rfind('/');
+  if (!options.recursive && stat(path, &st) == 0 && !S_ISDIR(st.st_mode) &&
+      slash != std::string::npos) {
+    std::string parent = slash == 0 ? "/" : watch.path.substr(0, slash);
+    int parent_wd = AddWatchDescriptor(parent, kWatchMask | IN_ONLYDIR, handle);
+    if (parent_wd != -1) {
+      watch.parent_wd = parent_wd;
+      watch.name = watch.path.substr(slash + 1);
+      Subscription parent_sub = { handle, parent };
+      g_descriptors[parent_wd].push_back(parent_sub);
+    } else if (errno == ENOSPC) {
+      // Polling sees replaced and resurrected files, a file watch without
+      // its parent would not.
+      StartPolling(&watch, false);
+      return handle;
+    }
+  }
+
+  if (options.recursive) {
+    // The tree is walked on the watcher thread.
+    ScanRequest request = { handle, watch.serial, watch.path, false };
+    g_scan_requests.push_back(request);
+    WakeupWatcherThread();
+  }
+
+  return handle;
 }
 
-void PlatformUnwatch(WatcherHandle fd) {
-  inotify_rm_watch(g_inotify, fd);
+void PlatformUnwatch(WatcherHandle handle) {
+  ScopedLocker locker(g_mutex);
+  WatchState* watch = FindWatch(handle);
+  if (watch == NULL)
+    return;
+
+  if (watch->root_wd != -1)
+    Unsubscribe(watch->root_wd, handle);
+  StopWatchingParent(watch);
+  for (std::map<std::string, int>::const_iterator iter = watch->dirs.begin();
+       iter != watch->dirs.end();
+       ++iter)
+    Unsubscribe(iter->second, handle);
+
+  g_watches.erase(handle);
+  g_free_handles.push_back(handle);
 }
 
 bool PlatformIsHandleValid(WatcherHandle handle) {
@@ -86,3 +1142,92 @@ bool PlatformIsHandleValid(WatcherHandle handle) {
 int PlatformInvalidHandleToErrorNumber(WatcherHandle handle) {
   return -handle;
 }
+
+// Counts the inotify instances of this process and the watches they hold,
+// which includes instances not created by us.
+static void CountProcessWatches(int64_t* instances, int64_t* watches) {
+  *instances = 0;
+  *watches = 0;
+
+  DIR* stream = opendir("/proc/self/fd");
+  if (stream == NULL) {
+    *instances = *watches = -1;
+    return;
+  }
+
+  while (dirent* entry = readdir(stream)) {
+    if (entry->d_name[0] == '.')
+      continue;
+
+    std::string fd_path = std::string("/proc/self/fd/") + entry->d_name;
+    char target[PATH_MAX];
+    ssize_t length = readlink(fd_path.c_str(), target, sizeof(target) - 1);
+    if (length == -1)
+      continue;
+    target[length] = '\0';
+    if (strcmp(target, "anon_inode:inotify") != 0)
+      continue;
+
+    ++*instances;
+    std::string info_path = std::string("/proc/self/fdinfo/") + entry->d_name;
+    FILE* file = fopen(info_path.c_str(), "r");
+    if (file == NULL)
+      continue;
+    char line[512];
+    while (fgets(line, sizeof(line), file) != NULL) {
+      if (strncmp(line, "inotify wd:", 11) == 0)
+        ++*watches;
+    }
+    fclose(file);
+  }
+  closedir(stream);
+}
+
+bool PlatformGetWatchLimits(WatchLimits* limits) {
+  limits->max_queued_events =
+      ReadProcValue("/proc/sys/fs/inotify/max_queued_events");
+  limits->max_user_watches =
+      ReadProcValue("/proc/sys/fs/inotify/max_user_watches");
+  limits->max_user_instances =
+      ReadProcValue("/proc/sys/fs/inotify/max_user_instances");
+  CountProcessWatches(&limits->instances, &limits->watches);
+  {
+    ScopedLocker locker(g_mutex);
+    limits->watch_budget = g_watch_budget == SIZE_MAX ? -1 : g_watch_budget;
+  }
+
+  int available = 0;
+  if (g_inotify != -1 && ioctl(g_inotify, FIONREAD, &available) == 0)
+    limits->queued_bytes = available;
+  else
+    limits->queued_bytes = -1;
+  return true;
+}
+
+void PlatformSetWatchBudget(int64_t budget) {
+  size_t value = budget > 0 ? static_cast<size_t>(budget) : DefaultWatchBudget();
+  ScopedLocker locker(g_mutex);
+  g_watch_budget = value;
+}
+
+void PlatformGetPolledWatches(std::vector<WatcherHandle>* handles) {
+  ScopedLocker locker(g_mutex);
+  for (WatchMap::const_iterator iter = g_watches.begin();
+       iter != g_watches.end();
+       ++iter) {
+    if (iter->second.poller)
+      handles->push_back(iter->first);
+  }
+}
+
+bool PlatformSimulateOverflow() {
+  if (g_inotify == -1)
+    return false;
+
+  {
+    ScopedLocker locker(g_mutex);
+    g_overflow_requested = true;
+  }
+  WakeupWatcherThread();
+  return true;
+}
@@ -34,14 +34,23 @@ void PlatformInit() {
   WakeupNewThread();
 }
 
+const char* PlatformName() {
+  return "kqueue";
+}
+
 void PlatformThread() {
   struct kevent event;
 
   while (true) {
     int r;
     do {
-      r = kevent(g_kqueue, NULL, 0, &event, 1, NULL);
+      FlushPendingEvents();
+
+      int timeout_ms = PendingEventsTimeout();
+      struct timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000 };
+      r = kevent(g_kqueue, NULL, 0, &event, 1, timeout_ms < 0 ? NULL : &timeout);
     } while ((r == -1 && errno == EINTR) || r == 0);
+    CountKernelEvents(1, sizeof(event));
 
     EVENT_TYPE type;
     int fd = static_cast<int>(event.ident);
@@ -68,15 +77,20 @@ void PlatformThread() {
       continue;
     }
 
-    PostEventAndWait(type, fd, path);
+    PostEvent(type, fd, path);
   }
 }
 
-WatcherHandle PlatformWatch(const char* path) {
+WatcherHandle PlatformWatch(const char* path, const WatchOptions& options) {
   if (g_kqueue == -1) {
     return -g_init_errno;
   }
 
+  // kqueue can only watch the directory itself.
+  if (options.recursive) {
+    return -ENOTSUP;
+  }
+
   int fd = open(path, O_EVTONLY, 0);
   if (fd < 0) {
     return -errno;
@@ -107,3 +121,17 @@ bool PlatformIsHandleValid(WatcherHandle handle) {
 int PlatformInvalidHandleToErrorNumber(WatcherHandle handle) {
   return -handle;
 }
+
+bool PlatformGetWatchLimits(WatchLimits* limits) {
+  return false;
+}
+
+void PlatformSetWatchBudget(int64_t budget) {
+}
+
+void PlatformGetPolledWatches(std::vector<WatcherHandle>* handles) {
+}
+
+bool PlatformSimulateOverflow() {
+  return false;
+}
@@ -7,8 +7,10 @@
 // Size of the buffer to store result of ReadDirectoryChangesW.
 static const unsigned int kDirectoryWatcherBufferSize = 4096;
 
-// Object template to create representation of WatcherHandle.
-static Nan::Persistent<ObjectTemplate> g_object_template;
+// Object template to create representation of WatcherHandle. Templates belong
+// to an isolate, and every environment runs on a thread of its own.
+static thread_local Nan::Persistent<ObjectTemplate>* t_object_template;
+static thread_local int t_environment_count;
 
 // Mutex for the HandleWrapper map.
 static uv_mutex_t g_handle_wrap_map_mutex;
@@ -22,19 +24,11 @@ static HANDLE g_wake_up_event;
 // The dummy event to ensure we are not waiting on a file handle when destroying it.
 static HANDLE g_file_handles_free_event;
 
-struct ScopedLocker {
-  explicit ScopedLocker(uv_mutex_t& mutex) : mutex_(&mutex) { uv_mutex_lock(mutex_); }
-  ~ScopedLocker() { Unlock(); }
-
-  void Unlock() { uv_mutex_unlock(mutex_); }
-
-  uv_mutex_t* mutex_;
-};
-
 struct HandleWrapper {
-  HandleWrapper(WatcherHandle handle, const char* path_str)
+  HandleWrapper(WatcherHandle handle, const char* path_str, bool recursive)
       : dir_handle(handle),
         path(strlen(path_str)),
+        recursive(recursive),
         canceled(false) {
     memset(&overlapped, 0, sizeof(overlapped));
     overlapped.hEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
@@ -62,6 +56,7 @@ struct HandleWrapper {
 
   WatcherHandle dir_handle;
   std::vector<char> path;
+  bool recursive;
   bool canceled;
   OVERLAPPED overlapped;
   char buffer[kDirectoryWatcherBufferSize];
@@ -73,18 +68,11 @@ struct HandleWrapper {
 
 std::map<WatcherHandle, HandleWrapper*> HandleWrapper::map_;
 
-struct WatcherEvent {
-  EVENT_TYPE type;
-  WatcherHandle handle;
-  std::vector<char> new_path;
-  std::vector<char> old_path;
-};
-
 static bool QueueReaddirchanges(HandleWrapper* handle) {
   return ReadDirectoryChangesW(handle->dir_handle,
                                handle->buffer,
                                kDirectoryWatcherBufferSize,
-                               FALSE,
+                               handle->recursive ? TRUE : FALSE,
                                FILE_NOTIFY_CHANGE_FILE_NAME      |
                                  FILE_NOTIFY_CHANGE_DIR_NAME     |
                                  FILE_NOTIFY_CHANGE_ATTRIBUTES   |
@@ -100,7 +88,7 @@ static bool QueueReaddirchanges(HandleWrapper* handle) {
 
 Local<Value> WatcherHandleToV8Value(WatcherHandle handle) {
   Local<v8::Context> context = Nan::GetCurrentContext();
-  Local<Value> value = Nan::New(g_object_template)->NewInstance(context).ToLocalChecked();
+  Local<Value> value = Nan::New(*t_object_template)->NewInstance(context).ToLocalChecked();
   Nan::SetInternalFieldPointer(value->ToObject(context).ToLocalChecked(), 0, handle);
   return value;
 }
@@ -122,12 +110,30 @@ void PlatformInit() {
   g_wake_up_event = CreateEvent(NULL, FALSE, FALSE, NULL);
   g_events.push_back(g_wake_up_event);
 
-  g_object_template.Reset(Nan::New<ObjectTemplate>());
-  Nan::New(g_object_template)->SetInternalFieldCount(1);
-
   WakeupNewThread();
 }
 
+void PlatformInitEnvironment() {
+  if (t_environment_count++ > 0)
+    return;
+
+  t_object_template = new Nan::Persistent<ObjectTemplate>(Nan::New<ObjectTemplate>());
+  Nan::New(*t_object_template)->SetInternalFieldCount(1);
+}
+
+void PlatformCleanupEnvironment() {
+  if (--t_environment_count > 0)
+    return;
+
+  t_object_template->Reset();
+  delete t_object_template;
+  t_object_template = NULL;
+}
+
+const char* PlatformName() {
+  return "windows";
+}
+
 void PlatformThread() {
   while (true) {
     // Do not use g_events directly, since reallocation could happen when there
@@ -137,12 +143,14 @@ void PlatformThread() {
     std::vector<HANDLE> copied_events(g_events);
     locker.Unlock();
 
+    int timeout_ms = PendingEventsTimeout();
     ResetEvent(g_file_handles_free_event);
     DWORD r = WaitForMultipleObjects(copied_events.size(),
                                      copied_events.data(),
                                      FALSE,
-                                     INFINITE);
+                                     timeout_ms < 0 ? INFINITE : timeout_ms);
     SetEvent(g_file_handles_free_event);
+    FlushPendingEvents();
     int i = r - WAIT_OBJECT_0;
     if (i >= 0 && i < copied_events.size()) {
       // It's a wake up event, there is no fs events.
@@ -160,6 +168,7 @@ void PlatformThread() {
         continue;
       if (bytes_transferred == 0)
         continue;
+      size_t notification_count = 0;
 
       std::vector<char> old_path;
       std::vector<WatcherEvent> events;
@@ -219,19 +228,23 @@ void PlatformThread() {
             old_path.swap(path);
           } else if (file_info->Action == FILE_ACTION_RENAMED_NEW_NAME) {
             WatcherEvent e = { event, handle->overlapped.hEvent };
+            e.count = 1;
             e.new_path.swap(path);
             e.old_path.swap(old_path);
             events.push_back(e);
           } else {
             WatcherEvent e = { event, handle->overlapped.hEvent };
+            e.count = 1;
             e.new_path.swap(path);
             events.push_back(e);
           }
         }
 
+        ++notification_count;
         if (file_info->NextEntryOffset == 0) break;
         offset += file_info->NextEntryOffset;
       }
+      CountKernelEvents(notification_count, bytes_transferred);
 
       // Restart the monitor, it was reset after each call.
       QueueReaddirchanges(handle);
@@ -239,15 +252,15 @@ void PlatformThread() {
       locker.Unlock();
 
       for (size_t i = 0; i < events.size(); ++i)
-        PostEventAndWait(events[i].type,
-                         events[i].handle,
-                         events[i].new_path,
-                         events[i].old_path);
+        PostEvent(events[i].type,
+                  events[i].handle,
+                  events[i].new_path,
+                  events[i].old_path);
     }
   }
 }
 
-WatcherHandle PlatformWatch(const char* path) {
+WatcherHandle PlatformWatch(const char* path, const WatchOptions& options) {
   wchar_t wpath[MAX_PATH] = { 0 };
   MultiByteToWideChar(CP_UTF8, 0, path, -1, wpath, MAX_PATH);
 
@@ -273,7 +286,7 @@ WatcherHandle PlatformWatch(const char* path) {
   std::unique_ptr<HandleWrapper> handle;
   {
     ScopedLocker locker(g_handle_wrap_map_mutex);
-    handle.reset(new HandleWrapper(dir_handle, path));
+    handle.reset(new HandleWrapper(dir_handle, path, options.recursive));
   }
 
   if (!QueueReaddirchanges(handle.get())) {
@@ -311,3 +324,17 @@ bool PlatformIsHandleValid(WatcherHandle handle) {
 int PlatformInvalidHandleToErrorNumber(WatcherHandle handle) {
   return 0;
 }
+
+bool PlatformGetWatchLimits(WatchLimits* limits) {
+  return false;
+}
+
+void PlatformSetWatchBudget(int64_t budget) {
+}
+
+void PlatformGetPolledWatches(std::vector<WatcherHandle>* handles) {
+}
+
+bool PlatformSimulateOverflow() {
+  return false;
+}
@@ -0,0 +1,323 @@
+#include "tree_snapshot.h"
+
+#include <string.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <unordered_map>
+
+#include "directory_listing.h"
+
+#ifdef _WIN32
+static const char kSeparator = '\\';
+#else
+static const char kSeparator = '/';
+#endif
+
+static const char kMagic[8] = { 'P', 'W', 'T', 'R', 'E', 'E', '0', '1' };
+static const uint32_t kNoChildren = 0xffffffff;
+
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t record_size;
+  uint32_t record_count;
+  uint64_t names_size;
+  uint64_t reserved;
+};
+
+// A directory whose entries still have to be compared.
+struct TreeSnapshot::Frame {
+  uint32_t index;
+  // The directory in the previous snapshot, kNoChildren if it is new.
+  uint32_t previous;
+  std::string path;
+};
+
+static uint32_t TypeOf(const uv_stat_t& stat) {
+  switch (stat.st_mode & S_IFMT) {
+    case S_IFREG:
+      return ENTRY_FILE;
+    case S_IFDIR:
+      return ENTRY_DIRECTORY;
+    default:
+      return ENTRY_OTHER;
+  }
+}
+
+static uint64_t MtimeOf(const uv_stat_t& stat) {
+  return static_cast<uint64_t>(stat.st_mtim.tv_sec) * 1000000000 + stat.st_mtim.tv_nsec;
+}
+
+static int Lstat(const std::string& path, uv_stat_t* stat) {
+  uv_fs_t req;
+  int r = uv_fs_lstat(NULL, &req, path.c_str(), NULL);
+  if (r == 0)
+    *stat = req.statbuf;
+  uv_fs_req_cleanup(&req);
+  return r;
+}
+
+static void AddChange(std::vector<TreeChange>* changes,
+                      EVENT_TYPE type,
+                      const std::string& path) {
+  TreeChange change = { type, path };
+  changes->push_back(change);
+}
+
+TreeSnapshot::TreeSnapshot() {
+}
+
+uint64_t TreeSnapshot::LatestMtime() const {
+  uint64_t latest = 0;
+  for (size_t i = 0; i < records_.size(); ++i)
+    latest = std::max(latest, records_[i].mtime_ns);
+  return latest;
+}
+
+uint32_t TreeSnapshot::Add(const std::string& name, const uv_stat_t& stat) {
+  Record record;
+  memset(&record, 0, sizeof(record));
+  record.ino = stat.st_ino;
+  record.size = stat.st_size;
+  record.mtime_ns = MtimeOf(stat);
+  record.type = TypeOf(stat);
+  record.name_offset = static_cast<uint32_t>(names_.size());
+  record.name_length = static_cast<uint32_t>(name.size());
+  record.first_child = kNoChildren;
+  names_.append(name);
+  records_.push_back(record);
+  return static_cast<uint32_t>(records_.size() - 1);
+}
+
+std::string TreeSnapshot::NameOf(const Record& record) const {
+  return names_.substr(record.name_offset, record.name_length);
+}
+
+void TreeSnapshot::AddDeletes(uint32_t index,
+                              const std::string& path,
+                              std::vector<TreeChange>* changes) const {
+  const Record& record = records_[index];
+  for (uint32_t i = 0; i < record.child_count; ++i) {
+    uint32_t child = record.first_child + i;
+    AddDeletes(child, path + kSeparator + NameOf(records_[child]), changes);
+  }
+  AddChange(changes, EVENT_CHILD_DELETE, path);
+}
+
+int TreeSnapshot::Scan(const std::string& root,
+                       const TreeSnapshot* previous,
+                       std::vector<TreeChange>* changes,
+                       bool recursive) {
+  records_.clear();
+  names_.clear();
+
+  uv_stat_t stat;
+  int r = Lstat(root, &stat);
+  if (r < 0)
+    return r;
+  if (TypeOf(stat) != ENTRY_DIRECTORY)
+    return UV_ENOTDIR;
+
+  if (previous != NULL && previous->records_.empty())
+    previous = NULL;
+  if (previous != NULL && previous->records_[0].type != ENTRY_DIRECTORY)
+    previous = NULL;
+
+  std::vector<Frame> stack;
+  Frame root_frame = { Add(std::string(), stat), previous ? 0 : kNoChildren, root };
+  stack.push_back(root_frame);
+
+  while (!stack.empty()) {
+    Frame frame = stack.back();
+    stack.pop_back();
+
+    const Record* old_dir = frame.previous == kNoChildren ?
+        NULL : &previous->records_[frame.previous];
+    // Entries of the directory in the previous snapshot, by name.
+    std::unordered_map<std::string, uint32_t> old_children;
+    if (old_dir != NULL) {
+      for (uint32_t i = 0; i < old_dir->child_count; ++i) {
+        uint32_t child = old_dir->first_child + i;
+        old_children[previous->NameOf(previous->records_[child])] = child;
+      }
+    }
+
+    // Adding or removing entries changes the mtime of a directory, so the
+    // names of an unchanged one are still those of the snapshot.
+    std::vector<std::string> names;
+    const Record& dir = records_[frame.index];
+    if (old_dir != NULL && old_dir->ino == dir.ino && old_dir->mtime_ns == dir.mtime_ns) {
+      names.reserve(old_children.size());
+      for (uint32_t i = 0; i < old_dir->child_count; ++i)
+        names.push_back(previous->NameOf(previous->records_[old_dir->first_child + i]));
+    } else {
+      std::vector<DirectoryEntry> entries;
+      ListDirectory(frame.path, &entries);
+      names.reserve(entries.size());
+      for (size_t i = 0; i < entries.size(); ++i)
+        names.push_back(entries[i].name);
+    }
+
+    records_[frame.index].first_child = static_cast<uint32_t>(records_.size());
+    for (size_t i = 0; i < names.size(); ++i) {
+      std::string path = frame.path + kSeparator + names[i];
+      // Gone since it was listed, it is reported with the other deletions.
+      if (Lstat(path, &stat) < 0)
+        continue;
+
+      uint32_t index = Add(names[i], stat);
+      ++records_[frame.index].child_count;
+      const Record& record = records_[index];
+
+      uint32_t old_index = kNoChildren;
+      std::unordered_map<std::string, uint32_t>::iterator old = old_children.find(names[i]);
+      if (old != old_children.end()) {
+        old_index = old->second;
+        old_children.erase(old);
+      }
+
+      if (changes != NULL && previous != NULL) {
+        const Record* old_record = old_index == kNoChildren ?
+            NULL : &previous->records_[old_index];
+        if (old_record != NULL && old_record->type != record.type) {
+          previous->AddDeletes(old_index, path, changes);
+          old_index = kNoChildren;
+          old_record = NULL;
+        }
+
+        if (old_record == NULL) {
+          AddChange(changes, EVENT_CHILD_CREATE, path);
+        } else if (record.type != ENTRY_DIRECTORY &&
+                   (old_record->ino != record.ino ||
+                    old_record->size != record.size ||
+                    old_record->mtime_ns != record.mtime_ns)) {
+          AddChange(changes, EVENT_CHILD_CHANGE, path);
+        }
+      }
+
+      if (record.type == ENTRY_DIRECTORY && recursive) {
+        Frame child = { index, old_index, path };
+        stack.push_back(child);
+      }
+    }
+    if (records_[frame.index].child_count == 0)
+      records_[frame.index].first_child = kNoChildren;
+
+    if (changes != NULL) {
+      std::unordered_map<std::string, uint32_t>::const_iterator iter;
+      for (iter = old_children.begin(); iter != old_children.end(); ++iter)
+        previous->AddDeletes(iter->second, frame.path + kSeparator + iter->first, changes);
+    }
+  }
+
+  return 0;
+}
+
+int TreeSnapshot::Load(const std::string& file) {
+  uv_fs_t req;
+  uv_file fd = uv_fs_open(NULL, &req, file.c_str(), UV_FS_O_RDONLY, 0, NULL);
+  uv_fs_req_cleanup(&req);
+  if (fd < 0)
+    return fd;
+
+  int r = uv_fs_fstat(NULL, &req, fd, NULL);
+  uint64_t file_size = r < 0 ? 0 : req.statbuf.st_size;
+  uv_fs_req_cleanup(&req);
+
+  std::vector<char> data;
+  if (r >= 0) {
+    data.resize(file_size);
+    size_t offset = 0;
+    while (offset < data.size()) {
+      uv_buf_t buf = uv_buf_init(data.data() + offset,
+                                 static_cast<unsigned int>(data.size() - offset));
+      r = uv_fs_read(NULL, &req, fd, &buf, 1, offset, NULL);
+      uv_fs_req_cleanup(&req);
+      if (r <= 0)
+        break;
+      offset += r;
+    }
+    if (r == 0 && offset < data.size())
+      r = UV_EOF;
+  }
+  uv_fs_close(NULL, &req, fd, NULL);
+  uv_fs_req_cleanup(&req);
+  if (r < 0)
+    return r;
+
+  SnapshotHeader header;
+  if (data.size() < sizeof(header))
+    return UV_EINVAL;
+  memcpy(&header, data.data(), sizeof(header));
+  uint64_t records_size = static_cast<uint64_t>(header.record_count) * sizeof(Record);
+  if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+      header.record_size != sizeof(Record) ||
+      sizeof(header) + records_size + header.names_size != data.size())
+    return UV_EINVAL;
+
+  records_.resize(header.record_count);
+  memcpy(records_.data(), data.data() + sizeof(header), records_size);
+  names_.assign(data.data() + sizeof(header) + records_size, header.names_size);
+
+  // Don't trust ranges that would make Scan read out of bounds.
+  for (size_t i = 0; i < records_.size(); ++i) {
+    const Record& record = records_[i];
+    if (static_cast<uint64_t>(record.name_offset) + record.name_length > names_.size() ||
+        (record.child_count > 0 &&
+         (record.first_child <= i ||
+          static_cast<uint64_t>(record.first_child) + record.child_count > records_.size()))) {
+      records_.clear();
+      names_.clear();
+      return UV_EINVAL;
+    }
+  }
+  return 0;
+}
+
+int TreeSnapshot::Save(const std::string& file) const {
+  SnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.record_size = sizeof(Record);
+  header.record_count = static_cast<uint32_t>(records_.size());
+  header.names_size = names_.size();
+
+  std::string temporary = file + ".tmp";
+  uv_fs_t req;
+  uv_file fd = uv_fs_open(NULL, &req, temporary.c_str(),
+                          UV_FS_O_WRONLY | UV_FS_O_CREAT | UV_FS_O_TRUNC, 0644, NULL);
+  uv_fs_req_cleanup(&req);
+  if (fd < 0)
+    return fd;
+
+  uv_buf_t bufs[] = {
+    uv_buf_init(reinterpret_cast<char*>(&header), sizeof(header)),
+    uv_buf_init(reinterpret_cast<char*>(const_cast<Record*>(records_.data())),
+                static_cast<unsigned int>(records_.size() * sizeof(Record))),
+    uv_buf_init(const_cast<char*>(names_.data()), static_cast<unsigned int>(names_.size())),
+  };
+  int r = 0;
+  for (size_t i = 0; i < sizeof(bufs) / sizeof(bufs[0]) && r >= 0; ++i) {
+    // Short writes continue where they stopped.
+    while (bufs[i].len > 0) {
+      r = uv_fs_write(NULL, &req, fd, &bufs[i], 1, -1, NULL);
+      uv_fs_req_cleanup(&req);
+      if (r < 0)
+        break;
+      bufs[i].base += r;
+      bufs[i].len -= r;
+    }
+  }
+  uv_fs_close(NULL, &req, fd, NULL);
+  uv_fs_req_cleanup(&req);
+
+  if (r >= 0) {
+    r = uv_fs_rename(NULL, &req, temporary.c_str(), file.c_str(), NULL);
+    uv_fs_req_cleanup(&req);
+  }
+  if (r < 0) {
+    uv_fs_unlink(NULL, &req, temporary.c_str(), NULL);
+    uv_fs_req_cleanup(&req);
+  }
+  return r < 0 ? r : 0;
+}
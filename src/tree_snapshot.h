@@ -0,0 +1,70 @@
+#ifndef SRC_TREE_SNAPSHOT_H_
+#define SRC_TREE_SNAPSHOT_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+struct TreeChange {
+  EVENT_TYPE type;
+  std::string path;
+};
+
+// The (ino, size, mtime) of every path below a root, stored on disk as fixed
+// size records followed by the entry names, so that it can be read back, or
+// mapped, without parsing. The children of a directory are consecutive
+// records, which lets a directory whose mtime did not change be listed from
+// the snapshot instead of read again.
+class TreeSnapshot {
+ public:
+  TreeSnapshot();
+
+  // Replaces the snapshot with the tree below |root|. When |previous| is not
+  // NULL the changes since it are appended to |changes|, as the child events
+  // live watching would have reported. Only the entries of |root| itself are
+  // looked at unless |recursive|. Returns 0 or a negative libuv error code.
+  int Scan(const std::string& root,
+           const TreeSnapshot* previous,
+           std::vector<TreeChange>* changes,
+           bool recursive = true);
+
+  int Load(const std::string& file);
+  // Writes to a temporary file that is renamed over |file|.
+  int Save(const std::string& file) const;
+
+  size_t size() const { return records_.size(); }
+  // Latest mtime of the paths in the snapshot, 0 when it is empty.
+  uint64_t LatestMtime() const;
+
+ private:
+  struct Record {
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime_ns;
+    // ENTRY_TYPE without the symlink flag, symlinks are not followed.
+    uint32_t type;
+    uint32_t name_offset;
+    uint32_t name_length;
+    // Children of directories, as a range of records.
+    uint32_t first_child;
+    uint32_t child_count;
+    uint32_t reserved;
+  };
+
+  struct Frame;
+
+  uint32_t Add(const std::string& name, const uv_stat_t& stat);
+  std::string NameOf(const Record& record) const;
+  // Reports |index| and everything below it as deleted, children first.
+  void AddDeletes(uint32_t index,
+                  const std::string& path,
+                  std::vector<TreeChange>* changes) const;
+
+  std::vector<Record> records_;
+  std::string names_;
+};
+
+#endif  // SRC_TREE_SNAPSHOT_H_
@@ -0,0 +1,107 @@
+#include "watch_registry.h"
+
+#include <stdio.h>
+
+#ifdef _WIN32
+static const char kSeparator = '\\';
+#else
+static const char kSeparator = '/';
+#endif
+
+static bool IsSeparator(char c) {
+#ifdef _WIN32
+  return c == '\\' || c == '/';
+#else
+  return c == '/';
+#endif
+}
+
+// Collapses repeated separators and "." segments and drops trailing
+// separators, without touching the file system.
+static std::string NormalizePath(const char* path) {
+  std::string normalized;
+  for (const char* p = path; *p != '\0'; ++p) {
+    if (IsSeparator(*p)) {
+      if (!normalized.empty() && normalized[normalized.size() - 1] == kSeparator)
+        continue;
+      // Skip "." segments.
+      if (p[1] == '.' && (p[2] == '\0' || IsSeparator(p[2]))) {
+        ++p;
+        if (normalized.empty())
+          normalized.push_back(kSeparator);
+        continue;
+      }
+      normalized.push_back(kSeparator);
+    } else {
+      normalized.push_back(*p);
+    }
+  }
+
+  while (normalized.size() > 1 &&
+         normalized[normalized.size() - 1] == kSeparator)
+    normalized.resize(normalized.size() - 1);
+  return normalized;
+}
+
+WatchRegistry::WatchRegistry() {
+}
+
+// static
+std::string WatchRegistry::MakeKey(const char* path,
+                                   const WatchOptions& options) {
+  char suffix[64];
+  snprintf(suffix, sizeof(suffix), "|%d|%d|%d|%d|%d|%d|%u",
+           options.recursive ? 1 : 0, options.coalesce_ms,
+           options.resurrect ? 1 : 0, options.stat ? 1 : 0,
+           options.poll ? 1 : 0, options.tail ? 1 : 0, options.block_size);
+  std::string key = NormalizePath(path) + suffix;
+  if (options.filter)
+    key += "|" + options.filter->key();
+  return key;
+}
+
+bool WatchRegistry::Acquire(const std::string& key, WatcherHandle* handle) {
+  std::unordered_map<std::string, WatcherHandle>::const_iterator iter =
+      by_key_.find(key);
+  if (iter == by_key_.end())
+    return false;
+
+  ++by_handle_[iter->second].references;
+  *handle = iter->second;
+  return true;
+}
+
+void WatchRegistry::Add(const std::string& key, WatcherHandle handle) {
+  Entry entry = { key, 1 };
+  by_key_[key] = handle;
+  by_handle_[handle] = entry;
+}
+
+bool WatchRegistry::Release(WatcherHandle handle) {
+  std::unordered_map<WatcherHandle, Entry>::iterator iter =
+      by_handle_.find(handle);
+  if (iter == by_handle_.end())
+    return false;
+
+  if (--iter->second.references > 0)
+    return false;
+
+  by_key_.erase(iter->second.key);
+  by_handle_.erase(iter);
+  return true;
+}
+
+bool WatchRegistry::Has(WatcherHandle handle) const {
+  return by_handle_.find(handle) != by_handle_.end();
+}
+
+std::vector<WatcherHandle> WatchRegistry::Handles() const {
+  std::vector<WatcherHandle> handles;
+  handles.reserve(by_handle_.size());
+  for (std::unordered_map<WatcherHandle, Entry>::const_iterator iter =
+           by_handle_.begin();
+       iter != by_handle_.end();
+       ++iter)
+    handles.push_back(iter->first);
+  return handles;
+}
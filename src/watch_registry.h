@@ -0,0 +1,46 @@
+#ifndef SRC_WATCH_REGISTRY_H_
+#define SRC_WATCH_REGISTRY_H_
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+
+// Index of the active watches by normalized path and options, so that watching
+// a path twice shares one handle. Handles are reference counted and only
+// unwatched when the last reference is released.
+class WatchRegistry {
+ public:
+  WatchRegistry();
+
+  // Returns the key identifying |path| watched with |options|.
+  static std::string MakeKey(const char* path, const WatchOptions& options);
+
+  // Takes a reference on the handle registered for |key|, returns false if
+  // there is none.
+  bool Acquire(const std::string& key, WatcherHandle* handle);
+  // Registers a newly watched handle with one reference.
+  void Add(const std::string& key, WatcherHandle handle);
+  // Drops a reference, returns true if it was the last one and the handle
+  // should be unwatched.
+  bool Release(WatcherHandle handle);
+
+  bool Has(WatcherHandle handle) const;
+  std::vector<WatcherHandle> Handles() const;
+  size_t size() const { return by_handle_.size(); }
+
+ private:
+  struct Entry {
+    std::string key;
+    int references;
+  };
+
+  std::unordered_map<std::string, WatcherHandle> by_key_;
+  std::unordered_map<WatcherHandle, Entry> by_handle_;
+
+  WatchRegistry(const WatchRegistry&);
+  void operator=(const WatchRegistry&);
+};
+
+#endif  // SRC_WATCH_REGISTRY_H_